@@ -109,15 +109,415 @@
  * http://www.ti.com/lit/pdf/spma043
  *
  * There is a lot of other information on the web about Cortex-M faults.
+ *
+ * CAPTURE AND DECODE
+ * ------------------
+ * The work is split into two steps.  CMx_FaultCapture() reads the stack
+ * frame and fault registers into a tCMxFaultRecord, and
+ * CMx_FaultRecordDecode() prints a record.  CMx_FaultDecoder() just does
+ * both.  The fault handler passes the EXC_RETURN value along with the
+ * stack frame so that the decoder knows which stack (MSP or PSP) the frame
+ * was on, whether FPU state was stacked, and can work out the stack
+ * pointer from before the fault (including any alignment padding word).
+ *
+ * HOST BUILDS
+ * -----------
+ * Since not every fault can be reproduced on hardware, the capture and
+ * decode path can also be compiled on a host and driven with synthetic
+ * exception frames, fault register values and EXC_RETURN values.  Define
+ * CMX_HOST_BUILD so that the fault handler (which has target assembly)
+ * is left out, and define CMX_REG32(addr) to read from a simulated
+ * memory map instead of the real system control space.  Then just call
+ * CMx_FaultDecoderEx() with a pointer to your fake stack frame (and fake
+ * special registers if you want).  Program
+ * memory reads go through CMX_READ16(addr) which can be redirected the
+ * same way.
+ *
+ * Host services that handle a lot of records can build this file as a
+ * shared library with CMX_SHARED_LIB and CMX_HOST_BUILD defined (with GCC
+ * add -shared -fPIC -fvisibility=hidden).  Only the functions marked
+ * CMX_API are exported.  They take packed records (see PACKED RECORDS)
+ * and write results to arrays the caller provides, so they do not depend
+ * on the layout of any structure, and a whole batch of records is
+ * decoded with a single call through an FFI.  Output from the decode
+ * functions goes to printf.
+ *
+ * For processing in several stages, CMx_FaultBatchColumn() pulls one
+ * field out of every record into an array, so each stage only touches the
+ * columns it uses.  CMx_FaultBatchSignature() works on those columns
+ * (but returns 0 with CMX_STABLE_SIGNATURE, see STABLE SIGNATURES).
+ *
+ * A store that keeps records in files by build ID and time window can
+ * skip any file whose build or window is outside of a query.
+ * CMx_FaultBatchSelect() finds the records of one build and time window
+ * in a batch, for splitting records up that way or for queries within a
+ * file.  None of the batch functions share any state, so a query can
+ * run on many files at once from different threads.
+ *
+ * Most words of most packed records are the same from one record to the
+ * next (the MPU setup, unused fields, ...).  For storing or sending a lot
+ * of them, CMx_RecordDictTrain() makes a dictionary from a sample of
+ * records, and CMx_RecordCompress() stores just the words that differ
+ * from it.  Each record is compressed on its own, so any record can be
+ * read back without the others.  These work on the device too, with a
+ * dictionary linked in as a table.
+ *
+ * To count faults by signature over more records than fit in memory,
+ * take them in batches that do fit.  Turn each batch into a sorted run
+ * of signatures and counts with CMx_SignatureRollup(), and write the run
+ * out.  Then combine the runs in pairs with CMx_SignatureMerge(), reading
+ * and writing them in pieces, until one is left.  Neither function
+ * allocates memory.
+ *
+ * The decoding functions do not use any global state, except for
+ * printing.  To decode from more than one thread, give each thread a
+ * tCMxDecodeCtx with its own output function (for example one that
+ * appends to a buffer for that thread) and call
+ * CMx_FaultRecordDecodeCtx().  No locking is needed.
+ *
+ * REPLAYING THE FAULTING INSTRUCTION
+ * ----------------------------------
+ * Sometimes the fault bits are ambiguous, for example whether a load hit
+ * unaligned device memory.  The record keeps a copy of the instruction
+ * halfwords leading up to and including the stacked PC (the last two
+ * halfwords cover a 32-bit faulting instruction).  Together with the
+ * stacked registers this is what you need to disassemble the faulting
+ * instruction and its predecessors, or to replay them in an emulator, and
+ * work out the effective address.  Capturing the code is skipped if the
+ * fault was on the instruction fetch, if the exception frame could not be
+ * stacked or unstacked (so the stacked PC is not valid), or if the PC is
+ * outside of the range CMX_CODE_START to CMX_CODE_END.  These have no
+ * defaults, so define them to the start and end of program memory, for
+ * example with -DCMX_CODE_START=0x08000000 -DCMX_CODE_END=0x08080000.
+ * If they are not defined no code is captured, and a fault can't be
+ * recovered from by skipping the instruction (see RECOVERING FROM
+ * FAULTS) unless it is an imprecise bus fault.
+ *
+ * SPECIAL REGISTERS AND INTERRUPTS
+ * --------------------------------
+ * The fault handler entry code reads CONTROL, PRIMASK, BASEPRI,
+ * FAULTMASK, MSP and PSP with a short fixed sequence of instructions
+ * before calling the decoder, and they are saved in the record.  The
+ * record also has the NVIC pending (ISPR) and active (IABR) bits for the
+ * first CMX_NVIC_WORDS * 32 interrupts, so you can see what interrupts
+ * were in progress when the fault happened.
+ *
+ * DEDICATED FAULT HANDLERS
+ * ------------------------
+ * By default every fault escalates to a hard fault, so all of them end up
+ * in CMx_FaultHandler().  On ARMv7-M you can instead enable the
+ * configurable fault handlers with CMx_FaultHandlersEnable() and put
+ * CMx_MemManageHandler(), CMx_BusFaultHandler() and
+ * CMx_UsageFaultHandler() in the vector table.  The decoder notes which
+ * handler it ran in (from ICSR.VECTACTIVE) and only prints the part of
+ * the fault status that applies, which keeps time in the handler down.
+ * A fault that still arrives as a hard fault (for example because its
+ * handler was masked) is shown with HFSR FORCED, so escalated faults can
+ * be told apart from the configurable ones.
+ *
+ * RECOVERING FROM FAULTS
+ * ----------------------
+ * Normally the fault handler hangs after printing.  For some faults it is
+ * better to log them and keep going, for example a divide by zero in
+ * non-critical math or a bus fault from an optional peripheral.  Register
+ * a policy function with CMx_FaultSetPolicy().  It is called with the
+ * captured record, and if it returns true the stacked PC is moved past
+ * the faulting instruction (working out if it is a 16 or 32-bit
+ * instruction, and advancing the IT state if it was in an IT block), the
+ * fault status bits are cleared and the handler returns.  The registers
+ * that the skipped instruction would have written are left unchanged.
+ *
+ * Some faults can't be recovered from no matter what the policy says:
+ * stacking errors, instruction fetch faults, INVPC and INVSTATE.  For an
+ * imprecise bus fault the stacked PC is not the instruction that caused
+ * it, so nothing is skipped.  CMx_ThumbInstrLen() and
+ * CMx_FaultSkipInstruction() can be used in a host build to check the PC
+ * adjustment against a set of instructions.
+ *
+ * PROBING MEMORY
+ * --------------
+ * Board variant detection often means reading peripherals that may not
+ * be there.  CMx_ProbeRead32() and CMx_ProbeRead32Multi() do the read
+ * with FAULTMASK and CCR.BFHFNMIGN set, so a bus fault is ignored and
+ * reported back as a failed read instead of going through the fault
+ * handler.  These are ARMv7-M only and are not built for ARMv6-M.
+ *
+ * MPU FAULTS
+ * ----------
+ * A MemManage access violation does not mean much without the MPU
+ * configuration, so the MPU type, control and the base and attribute
+ * registers of each region (up to CMX_MPU_REGIONS) are saved in the
+ * record.  For DACCVIOL and IACCVIOL the decoder prints the region that
+ * the faulting address is in, or whether the background region applied,
+ * along with the access permissions and execute never bit.  Overlapping
+ * regions and disabled subregions are taken into account.  The matching
+ * is done by CMx_FaultMpuMatch() which can also be used on its own.
+ *
+ * SEVERITY
+ * --------
+ * Every record is given a fault class and a severity by
+ * CMx_FaultClassify(), using a small decision table over CFSR and HFSR,
+ * plus the fault address (an access near 0 is a null pointer), the stack
+ * check and whether the fault was in an interrupt handler.  The retained
+ * fault log (below) uses the severity so that after a reset
+ * CMx_FaultLogNextToSend() gives the most severe faults first, and when
+ * the log is full a fault that was already sent, or else the least severe
+ * fault, is the one that is replaced.  A fault that has not been sent is
+ * never replaced by a less severe one.
+ *
+ * FAULT LOG AND STORM SUPPRESSION
+ * -------------------------------
+ * If CMX_FAULT_LOG is defined, each fault is also saved in a small table
+ * of records that lives in RAM that is not cleared at startup, so the
+ * application can read it back (CMx_FaultLogGet()) and report it after
+ * the system is reset.  Each entry is keyed by a fault signature (a hash
+ * of PC, LR and the fault status registers, see CMx_FaultSignature())
+ * and counts how many times that signature occurred.
+ *
+ * A flapping peripheral can cause the same fault again after every
+ * reset.  Once a signature has been seen more than
+ * CMX_FAULT_STORM_THRESHOLD times within CMX_FAULT_STORM_WINDOW, the full
+ * decode is not printed any more.  Instead a single summary line with
+ * the signature and the counts is printed.  The window is measured with
+ * the record timestamps (see TIMESTAMPS) and starts at the first
+ * occurrence, and when it has passed the next occurrence starts a new
+ * window and is decoded in full again.  Without a time source every
+ * timestamp is 0 and the window never ends.
+ *
+ * The log survives a firmware update as long as the new firmware lays it
+ * out the same way.  If a fault log field was added or one of the
+ * configuration macros that size the record (CMX_FAULT_LOG_ENTRIES,
+ * CMX_MPU_REGIONS, CMX_NVIC_WORDS, CMX_MAX_STACKS, ...) changed, the
+ * old contents can't be read and the log is cleared.
+ *
+ * The log must be placed in a memory section that the startup code does
+ * not zero or initialize.  With GCC it goes into a section named
+ * ".noinit" which you may need to add to your linker script.  For other
+ * compilers, or a different section, define CMX_FAULT_LOG_ATTR.
+ *
+ * The table only holds a few full records, but the log also keeps a
+ * compact history of every fault as (time, signature, build ID) events so
+ * faults can be lined up with firmware updates.  Each event is stored as
+ * the varint encoded difference from the event before, so most take 6
+ * bytes and none more than 14.  CMX_FAULT_HISTORY_BYTES has to be at
+ * least 14, and when it is used up the oldest events are dropped.  Read
+ * it back with CMx_FaultHistoryRead().  The time is the record timestamp
+ * (see below) and the build ID comes from CMX_BUILD_ID, which you should
+ * define for your application.  The build ID is also saved in every
+ * fault record.
+ *
+ * SENDING THE FAULT LOG
+ * ---------------------
+ * The device can reset at any time, including after an entry was sent
+ * but before CMx_FaultLogMarkSent() was called, so the same entry can be
+ * sent more than once.  An entry is also sent again, with a higher
+ * count, when its fault repeats.  Pack entries with
+ * CMx_FaultLogEntryPack(), which adds the entry sequence number and count
+ * to the record.  The receiver identifies an entry by the device, the
+ * sequence number and the record timestamp (the sequence numbers restart
+ * if the log is cleared).  It keeps the highest count it has seen for each
+ * one, and only adds the amount by which a new count is higher.  Then a
+ * record that is received twice is not counted twice, and a receiver
+ * that restarts only needs that table (saved together with how far it
+ * got in its input) to carry on where it left off.
+ *
+ * TIMESTAMPS
+ * ----------
+ * A fault record has no time unless the application provides one.
+ * Register a time source with CMx_FaultSetTimeSource() and it is called
+ * first thing when the fault is captured.  It can return anything that
+ * makes sense for the application: a SysTick or RTOS tick count, seconds
+ * from an RTC, or in a host build a value from the test harness.  The
+ * units are up to you, but if the records are sent off the device it
+ * is best to use wall clock time so faults that are reported after a
+ * reset still line up.  It must be safe to call from the fault handler,
+ * so it should just read a counter and not take any locks.
+ *
+ * PACKED RECORDS
+ * --------------
+ * tCMxFaultRecord changes as fields are added and depends on how the
+ * decoder is configured, so it is not a good format for records that are
+ * sent off the device.  CMx_FaultRecordPack() writes a record in a
+ * versioned format where every field has a fixed offset and a presence
+ * bit (see CMX_RECORD_FIELDS() in the header).  Fields are only added at
+ * the end, so records from old firmware can still be read.  A host tool
+ * reads fields in place, for example from a memory mapped file, with the
+ * CMx_Record_xxx() accessors, which return 0 for a field the record does
+ * not have.  There is nothing to parse per record.
+ *
+ * STACK OVERFLOW CHECK
+ * --------------------
+ * Stack overflows are a common cause of faults that are hard to explain.
+ * The application can register its stacks (the main stack and each task
+ * stack) with CMx_FaultSetStacks().  Each stack must be filled with
+ * CMX_STACK_PAINT before it is used, with CMx_StackPaint() or by the
+ * startup code or RTOS.  At fault time every stack is scanned from the
+ * bottom up for words that still hold the paint, and the number of bytes
+ * that were never used is saved in the record.  If any of the
+ * CMX_STACK_GUARD_WORDS words at the bottom of a stack were overwritten,
+ * the stack is flagged as overflowed.
+ *
+ * HEAP CHECK
+ * ----------
+ * Heap corruption is often the real cause of a fault that shows up much
+ * later.  If the application registers a heap adapter with
+ * CMx_FaultSetHeapAdapter(), the fault handler walks the heap and saves
+ * the first block with a bad header, along with the number of blocks and
+ * the used, free and largest free sizes.  The adapter knows the layout of
+ * the block headers for your allocator (newlib, an RTOS heap, ...) and
+ * the decoder just follows the blocks from the start of the heap to the
+ * end, checking that each one stays in bounds.
+ *
+ * To keep the time spent in the fault handler bounded, the walk stops
+ * after CMX_HEAP_BUDGET_CYCLES cycles (using the DWT cycle counter) or
+ * CMX_HEAP_MAX_BLOCKS blocks, whichever comes first.  The record shows if
+ * the walk ran out of time and where it stopped.  ARMv6-M and ARMv8-M
+ * Baseline parts have no cycle counter, so on those only the block limit
+ * applies.
+ *
+ * MULTI-CORE PARTS
+ * ----------------
+ * On parts with more than one core, either core can fault, sometimes at
+ * the same time.  If CMX_FAULT_SHARED_LOG is defined, each fault is also
+ * written to a log in RAM that all cores can see.  Each core claims a
+ * slot atomically, with exclusive load and store on ARMv7-M or with the
+ * CMX_SHARED_LOCK() and CMX_SHARED_UNLOCK() hooks (for example a hardware
+ * spinlock) on ARMv6-M, and records its ID from CMX_CORE_ID().  When a
+ * fault is decoded, faults from the other cores within
+ * CMX_FAULT_SHARED_WINDOW time units of it are printed too, which needs a
+ * time source that all cores share.
+ *
+ * The log is placed in the section ".noinit.shared" or, if the cores run
+ * separate images, at the address CMX_FAULT_SHARED_ADDR.  One core must
+ * call CMx_FaultSharedLogInit() at startup, which also counts the boot so
+ * that only faults since the last reset are related.  Like the fault log
+ * it is cleared if the layout changed, and separate images must be built
+ * with the same configuration or the other cores don't add to it.
+ *
+ * The fault handler keeps the record it is working on in static memory
+ * rather than on the stack, which may be what overflowed.  If the cores
+ * run the same image, define CMX_CORE_COUNT and CMX_CORE_ID() even
+ * without the shared log, so that each core gets its own record.
+ *
+ * STABLE SIGNATURES
+ * -----------------
+ * The fault signature normally includes the PC and LR, which change
+ * whenever the code moves in a new build.  Then every release starts a
+ * new set of signatures, and the known faults filter has to be rebuilt.
+ * If CMX_STABLE_SIGNATURE is defined, a fault where the code was captured
+ * (see REPLAYING THE FAULTING INSTRUCTION) is instead identified by the
+ * last CMX_STABLE_SIGNATURE_HALFWORDS halfwords of code (up to and just
+ * after the PC) and the fault status registers, so it keeps the same
+ * signature as long as that code does not change.  The offsets of
+ * branches, calls, PC relative loads and ADR are masked out, since they
+ * change when anything moves.  Any host tools that compute signatures
+ * need to be built with the same setting.
+ *
+ * The location is not part of this signature, so faults in different
+ * places with the same code in the window and the same status bits get
+ * the same signature.  Short common sequences are the most likely to
+ * collide, for example a null pointer load right after another load
+ * through the same register.  The window is 8 halfwords by default, which
+ * is also the most that a packed record holds, and can be made smaller
+ * but not larger.  A change that is only in a masked offset is not seen.
+ * CMx_FaultBatchSignature() works from PC and LR columns, so with this
+ * setting it computes nothing and returns 0.
+ *
+ * KNOWN FAULTS
+ * ------------
+ * Most faults seen in the field have already been triaged.  The
+ * application can register a Bloom filter of known fault signatures
+ * with CMx_FaultSetKnown().  A fault whose signature is in the filter is
+ * still counted in the fault log, but only a one line summary is printed
+ * so that the expensive output and analysis is spent on new faults.
+ *
+ * The filter is normally built offline (for example by a host build of
+ * this file calling CMx_FaultBloomAdd() for each triaged signature) and
+ * linked in as a table.  With m bits, n signatures and k hashes the false
+ * positive rate is about (1 - e^(-k*n/m))^k, and the best k is about
+ * (m/n) * 0.69.  For example 1024 bits holding 64 signatures with k = 11
+ * gives roughly 1 false positive per 2000 new faults.  A false positive
+ * only means a new fault is summarized instead of fully decoded, and its
+ * signature and count are still in the log.
  */
 
+#ifdef CMX_SHARED_LIB
+/* A shared library has no application to provide DbgPrintf */
+#include <stdio.h>
+#define DbgPrintf printf
+#else
 /* printf-like function that sends output somewhere (like serial) */
 extern int DbgPrintf(const char *format, ...);
+#endif
+
+/*
+ * All access to the system control space goes through this macro.  On a
+ * target it is just a volatile read of the register address.  For a host
+ * build you can define it before this file is compiled so that register
+ * reads come from a simulated memory map instead.
+ */
+#ifndef CMX_REG32
+#define CMX_REG32(addr) (*((volatile uint32_t *)(uintptr_t)(addr)))
+#endif
+
+/*
+ * Reads of program memory (to capture the instruction that faulted) go
+ * through this macro, for the same reason.
+ */
+#ifndef CMX_READ16
+#define CMX_READ16(addr) (*((volatile uint16_t *)(uintptr_t)(addr)))
+#endif
+
+/*
+ * Address range that is safe to read code from when capturing the
+ * faulting instruction, usually the start and end of flash.  There is no
+ * default because reading past the end of flash faults again in the
+ * fault handler, and only the application knows where its flash ends.
+ * Without it the code is not captured.
+ */
+#if defined(CMX_CODE_START) != defined(CMX_CODE_END)
+#error "Define both CMX_CODE_START and CMX_CODE_END, or neither"
+#elif defined(CMX_CODE_START)
+#if (CMX_CODE_END - CMX_CODE_START) < (CMX_CODE_HALFWORDS * 2)
+#error "CMX_CODE_START to CMX_CODE_END is too small to capture any code"
+#endif
+#endif
+
+/*
+ * ID of the core that is running this code, from 0 to CMX_CORE_COUNT - 1.
+ * Define this for your part, for example by reading a vendor CPU ID
+ * register.
+ */
+#ifndef CMX_CORE_ID
+#define CMX_CORE_ID() 0
+#endif
 
 /* Macros for reading the fault registers */
-#define NVIC_ReadCFSR() (*((volatile uint32_t *)(0xE000ED28)))
-#define NVIC_ReadMMFAR() (*((volatile uint32_t *)(0xE000ED34)))
-#define NVIC_ReadBFAR() (*((volatile uint32_t *)(0xE000ED38)))
+#define NVIC_ReadICSR() CMX_REG32(0xE000ED04)
+#define NVIC_ReadISPR(n) CMX_REG32(0xE000E200 + ((n) * 4))
+#define NVIC_ReadIABR(n) CMX_REG32(0xE000E300 + ((n) * 4))
+#define NVIC_CCR CMX_REG32(0xE000ED14)
+#define NVIC_SHCSR CMX_REG32(0xE000ED24)
+#define NVIC_ReadCFSR() CMX_REG32(0xE000ED28)
+#define NVIC_ReadHFSR() CMX_REG32(0xE000ED2C)
+#define NVIC_ReadMMFAR() CMX_REG32(0xE000ED34)
+#define NVIC_ReadBFAR() CMX_REG32(0xE000ED38)
+#define NVIC_CFSR CMX_REG32(0xE000ED28)
+#define NVIC_HFSR CMX_REG32(0xE000ED2C)
+
+/* MPU registers */
+#define MPU_TYPE                CMX_REG32(0xE000ED90)
+#define MPU_CTRL                CMX_REG32(0xE000ED94)
+#define MPU_RNR                 CMX_REG32(0xE000ED98)
+#define MPU_RBAR                CMX_REG32(0xE000ED9C)
+#define MPU_RASR                CMX_REG32(0xE000EDA0)
+
+/* Debug registers used for the cycle counter */
+#define DEMCR                   CMX_REG32(0xE000EDFC)
+#define DWT_CTRL                CMX_REG32(0xE0001000)
+#define DWT_CYCCNT              CMX_REG32(0xE0001004)
+#define DEMCR_TRCENA            0x01000000
+#define DWT_CTRL_CYCCNTENA      0x00000001
 
 /* Define bit fields of the fault registers */
 #define NVIC_CFSR_MMARVALID     0x00000080
@@ -142,120 +542,2859 @@ extern int DbgPrintf(const char *format, ...);
 #define NVIC_CFSR_INVSTATE      0x00020000
 #define NVIC_CFSR_UNDEFINSTR    0x00010000
 
+#define NVIC_ICSR_VECTACTIVE_M  0x000001FF
+
+#define NVIC_CCR_BFHFNMIGN      0x00000100
+
+#define NVIC_HFSR_DEBUGEVT      0x80000000
+#define NVIC_HFSR_FORCED        0x40000000
+#define NVIC_HFSR_VECTTBL       0x00000002
+
+/* Define bit fields of the MPU registers */
+#define MPU_TYPE_DREGION_M      0x0000FF00
+#define MPU_TYPE_DREGION_S      8
+#define MPU_CTRL_PRIVDEFENA     0x00000004
+#define MPU_CTRL_ENABLE         0x00000001
+#define MPU_RASR_XN             0x10000000
+#define MPU_RASR_AP_M           0x07000000
+#define MPU_RASR_AP_S           24
+#define MPU_RASR_SRD_M          0x0000FF00
+#define MPU_RASR_SRD_S          8
+#define MPU_RASR_SIZE_M         0x0000003E
+#define MPU_RASR_SIZE_S         1
+#define MPU_RASR_ENABLE         0x00000001
+
+/* Define bit fields of the EXC_RETURN value and stacked xPSR */
+#define EXC_RETURN_BASIC_FRAME  0x00000010
+#define EXC_RETURN_PSP          0x00000004
+#define EXC_RETURN_THREAD       0x00000008
+#define XPSR_STACK_ALIGN        0x00000200
+#define XPSR_IT_LOW_M           0x06000000
+#define XPSR_IT_HIGH_M          0x0000FC00
+
+/* Value used to tell if the retained fault log has been initialized */
+#define CMX_FAULT_LOG_MAGIC     0x464C4F47
+
 /*
- * Print exception stack frame and fault registers.
+ * The retained logs survive a firmware update, so they also record how
+ * they are laid out and are cleared if that does not match the running
+ * code.  Increase CMX_FAULT_LOG_LAYOUT whenever a field is added to,
+ * removed from, or moved in tCMxFaultLog, tCMxFaultSharedLog or the
+ * structures they contain.  The size and the configuration macros that
+ * size the arrays in the record are checked as well, since those change
+ * the layout without any change to the code.
+ */
+#define CMX_FAULT_LOG_LAYOUT    2
+#define LOG_LAYOUT(log)         ((CMX_FAULT_LOG_LAYOUT << 24) | (uint32_t)sizeof(log))
+#define LOG_CONFIG              (((uint32_t)CMX_MPU_REGIONS << 24)           \
+                               | ((uint32_t)CMX_NVIC_WORDS << 16)          \
+                               | ((uint32_t)CMX_MAX_STACKS << 8)           \
+                               | (uint32_t)CMX_CODE_HALFWORDS)
+
+/* Size in bytes of the basic and extended (FPU) exception stack frames */
+#define FRAME_SIZE_BASIC        0x20
+#define FRAME_SIZE_FPU          0x68
+
+/* Application adapter for walking the heap */
+static const tCMxHeapAdapter *g_pHeapAdapter;
+
+/*
+ * Register an adapter that lets the fault handler walk the heap.  See
+ * tCMxHeapAdapter for what the adapter needs to provide.
+ *
+ * @param pAdapter is the heap adapter, or NULL to not check the heap
+ */
+void
+CMx_FaultSetHeapAdapter(const tCMxHeapAdapter *pAdapter)
+{
+    g_pHeapAdapter = pAdapter;
+}
+
+/*
+ * Cycle count used for the heap check budget.  ARMv6-M and ARMv8-M
+ * Baseline have no cycle counter, and may not have a DWT at all, so
+ * there it is not touched and only the block limit applies.
+ */
+#if defined(__ARM_ARCH_6M__) || defined(__ARM_ARCH_8M_BASE__)
+#define HEAP_CYCLES() 0U
+#else
+#define HEAP_CYCLES() DWT_CYCCNT
+#endif
+
+/*
+ * Walk the heap block by block and check that each block header makes
+ * sense, collecting statistics on the way.  This stops at the first bad
+ * block, or when the cycle budget (measured with the DWT cycle counter)
+ * or the block limit runs out, so the time spent in the fault handler
+ * stays bounded.
+ */
+static void
+HeapCheck(tCMxFaultRecord *pRecord)
+{
+    const tCMxHeapAdapter *pHeap = g_pHeapAdapter;
+    uint32_t block = pHeap->start;
+
+    pRecord->heapStatus = CMX_HEAP_OK;
+    pRecord->heapBadBlock = 0;
+    pRecord->heapBlocks = 0;
+    pRecord->heapUsed = 0;
+    pRecord->heapFree = 0;
+    pRecord->heapLargestFree = 0;
+
+    // Make sure the cycle counter is running
+#if !defined(__ARM_ARCH_6M__) && !defined(__ARM_ARCH_8M_BASE__)
+    DEMCR |= DEMCR_TRCENA;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+#endif
+    uint32_t startCycles = HEAP_CYCLES();
+
+    while (block != pHeap->end)
+    {
+        if ((pRecord->heapBlocks >= CMX_HEAP_MAX_BLOCKS)
+         || ((HEAP_CYCLES() - startCycles) > CMX_HEAP_BUDGET_CYCLES))
+        {
+            pRecord->heapStatus = CMX_HEAP_BUDGET;
+            pRecord->heapBadBlock = block;
+            return;
+        }
+
+        // The adapter checks the allocator specific parts of the header.
+        // The next block has to be further on and still in the heap,
+        // otherwise the header is corrupt and following it could fault.
+        uint32_t next;
+        uint32_t size;
+        bool isFree;
+        if ((block < pHeap->start) || (block > pHeap->end)
+         || !pHeap->pfnBlock(block, &next, &size, &isFree)
+         || (next <= block) || (next > pHeap->end))
+        {
+            pRecord->heapStatus = CMX_HEAP_CORRUPT;
+            pRecord->heapBadBlock = block;
+            return;
+        }
+
+        pRecord->heapBlocks++;
+        if (isFree)
+        {
+            pRecord->heapFree += size;
+            if (size > pRecord->heapLargestFree)
+            {
+                pRecord->heapLargestFree = size;
+            }
+        }
+        else
+        {
+            pRecord->heapUsed += size;
+        }
+        block = next;
+    }
+}
+
+/* stackOverflow in the fault record has one bit per stack */
+#if CMX_MAX_STACKS > 32
+#error "CMX_MAX_STACKS must be at most 32"
+#endif
+
+/* Stacks that the application registered for checking */
+static const tCMxStack *g_pStacks;
+static uint32_t g_numStacks;
+
+/*
+ * Register the stacks that are checked for overflow when a fault
+ * happens.  Only the first CMX_MAX_STACKS are checked.  The array is not
+ * copied so it has to stay valid, which lets an RTOS application update
+ * it as tasks come and go.
+ *
+ * @param pStacks is an array of stack descriptions
+ * @param count is the number of stacks in the array
+ */
+void
+CMx_FaultSetStacks(const tCMxStack *pStacks, uint32_t count)
+{
+    g_pStacks = pStacks;
+    g_numStacks = count;
+}
+
+/*
+ * Fill a stack with the paint pattern so its high water mark can be
+ * measured later.  Do not use this on the stack that is in use.
+ *
+ * @param base is the lowest address of the stack
+ * @param size is the size of the stack in bytes
+ */
+void
+CMx_StackPaint(uint32_t base, uint32_t size)
+{
+    volatile uint32_t *pWord = (volatile uint32_t *)(uintptr_t)base;
+
+    for (uint32_t i = 0; i < (size / 4); i++)
+    {
+        pWord[i] = CMX_STACK_PAINT;
+    }
+}
+
+/*
+ * Measure how much of a painted stack has never been used.  Stacks grow
+ * down, so this counts the paint words from the lowest address up until
+ * the first word that was written.  The loop compares 4 words at a time
+ * since it may have to scan a lot of stack in the fault handler.
+ *
+ * @param base is the lowest address of the stack
+ * @param size is the size of the stack in bytes
+ *
+ * @return the number of bytes at the bottom of the stack that were never
+ * used
+ */
+uint32_t
+CMx_StackHeadroom(uint32_t base, uint32_t size)
+{
+    const volatile uint32_t *pStart = (const volatile uint32_t *)(uintptr_t)base;
+    const volatile uint32_t *pWord = pStart;
+    const volatile uint32_t *pEnd = pStart + (size / 4);
+
+    while ((pEnd - pWord) >= 4)
+    {
+        if ((pWord[0] != CMX_STACK_PAINT) | (pWord[1] != CMX_STACK_PAINT)
+          | (pWord[2] != CMX_STACK_PAINT) | (pWord[3] != CMX_STACK_PAINT))
+        {
+            break;
+        }
+        pWord += 4;
+    }
+    while ((pWord < pEnd) && (*pWord == CMX_STACK_PAINT))
+    {
+        pWord++;
+    }
+    return (uint32_t)(pWord - pStart) * 4;
+}
+
+/*
+ * Build ID stored in each fault record.  Define this for your
+ * application, for example it could be a build number or the first word
+ * of a GNU build ID.
+ */
+#ifndef CMX_BUILD_ID
+#define CMX_BUILD_ID 0
+#endif
+
+/* Application function that provides the time of a fault */
+static tCMxTimeSource g_pfnTimeSource;
+
+/*
+ * Register the function used to timestamp fault records.
+ *
+ * @param pfnTime returns the current time in whatever units the
+ * application uses, or NULL to leave records with a time of 0
+ */
+void
+CMx_FaultSetTimeSource(tCMxTimeSource pfnTime)
+{
+    g_pfnTimeSource = pfnTime;
+}
+
+/*
+ * Capture the exception stack frame and fault registers into a record.
+ * This only reads state, it does not print anything, so the record can
+ * be decoded later or somewhere else.
  *
+ * @param pRecord is storage for the captured fault information
  * @param pStackFrame points at the memory location of the exception
  * stack frame
+ * @param excReturn is the EXC_RETURN value that was in LR when the fault
+ * handler was entered, or 0 if it is not known
+ * @param pSpecial is the special registers read on entry to the fault
+ * handler, or NULL if they are not known
  */
 void
-CMx_FaultDecoder(uint32_t *pStackFrame)
+CMx_FaultCapture(tCMxFaultRecord *pRecord, uint32_t *pStackFrame,
+                 uint32_t excReturn, const tCMxSpecialRegs *pSpecial)
 {
+    // Get the time first so it is as close to the fault as possible
+    uint32_t timestamp = (g_pfnTimeSource != 0) ? g_pfnTimeSource() : 0;
+
+    // Start from all 0 so that array entries that are not captured (MPU
+    // regions the part doesn't have, stacks that aren't registered) do
+    // not hold whatever was on the stack, since the record is packed and
+    // sent as a whole.
+    uint8_t *pClear = (uint8_t *)pRecord;
+    for (uint32_t i = 0; i < sizeof(*pRecord); i++)
+    {
+        pClear[i] = 0;
+    }
+    pRecord->timestamp = timestamp;
+    pRecord->buildId = CMX_BUILD_ID;
+
+    // Copy the 8 registers that were pushed in the exception stack frame
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        pRecord->frame[i] = pStackFrame[i];
+    }
+
+    // Work out what the stack pointer was before the exception frame
+    // was pushed.  The frame is larger if FPU state was stacked, and
+    // there may be an extra padding word if the processor had to align
+    // the stack to 8 bytes (indicated by bit 9 of stacked xPSR).
+    uint32_t sp = (uint32_t)(uintptr_t)pStackFrame;
+    if (excReturn != 0)
+    {
+        sp += (excReturn & EXC_RETURN_BASIC_FRAME) ? FRAME_SIZE_BASIC
+                                                   : FRAME_SIZE_FPU;
+    }
+    else
+    {
+        sp += FRAME_SIZE_BASIC;
+    }
+    if (pRecord->frame[7] & XPSR_STACK_ALIGN)
+    {
+        sp += 4;
+    }
+    pRecord->excReturn = excReturn;
+    pRecord->sp = sp;
+
+    // Save the special registers that were read by the fault handler
+    // entry code.  These can't be read from C without changing them.
+    if (pSpecial != 0)
+    {
+        pRecord->special = *pSpecial;
+    }
+    else
+    {
+        tCMxSpecialRegs none = { 0 };
+        pRecord->special = none;
+    }
+
+    // Save which interrupts were pending and which were active (had been
+    // preempted) when the fault happened.  ARMv6-M has no active bit
+    // registers.
+    for (uint32_t i = 0; i < CMX_NVIC_WORDS; i++)
+    {
+        pRecord->nvicPending[i] = NVIC_ReadISPR(i);
+#if defined(__ARM_ARCH_6M__) || defined(__ARM_ARCH_8M_BASE__)
+        pRecord->nvicActive[i] = 0;
+#else
+        pRecord->nvicActive[i] = NVIC_ReadIABR(i);
+#endif
+    }
+
+    // Remember which exception handler is running, so a configurable
+    // fault can be told apart from one that escalated to a hard fault
+    pRecord->exception = NVIC_ReadICSR() & NVIC_ICSR_VECTACTIVE_M;
+
     // read the configurable fault status register, which has all the
     // fault cause bits.  Also read the fault address registers in case
     // they are useful
-    uint32_t cfsr = NVIC_ReadCFSR();
-    uint32_t mmfar = NVIC_ReadMMFAR();
-    uint32_t bfar = NVIC_ReadBFAR();
-
-    // Read the exception stack frame and print the values of the 8
-    // registers that were pushed there.
-    DbgPrintf("\n*** Fault occurred ***\n\n");
-    DbgPrintf("Stack Frame\n----------\n");
-    DbgPrintf("   R0       R1       R2       R3      R12       LR       PC     xPSR\n");
-    //          XXXXXXXX XXXXXXXX XXXXXXXX XXXXXXXX XXXXXXXX XXXXXXXX XXXXXXXX XXXXXXXX
-    for (uint32_t i = 0; i < 8; i++)
+    pRecord->cfsr = NVIC_ReadCFSR();
+    pRecord->hfsr = NVIC_ReadHFSR();
+    pRecord->mmfar = NVIC_ReadMMFAR();
+    pRecord->bfar = NVIC_ReadBFAR();
+
+    // Save the MPU configuration so a MemManage fault can be matched to
+    // the region that denied the access.  The region number register has
+    // to be changed to read each region, so it is put back afterwards in
+    // case the application continues.  If there is no MPU then DREGION
+    // reads as 0 and nothing is read.
+    // Skip this in the bus and usage fault handlers since it can't be
+    // relevant there.
+    uint32_t regions = 0;
+    if ((pRecord->exception != CMX_EXC_BUSFAULT)
+     && (pRecord->exception != CMX_EXC_USAGEFAULT))
+    {
+        pRecord->mpuType = MPU_TYPE;
+        pRecord->mpuCtrl = MPU_CTRL;
+        regions = (pRecord->mpuType & MPU_TYPE_DREGION_M) >> MPU_TYPE_DREGION_S;
+    }
+    else
+    {
+        pRecord->mpuType = 0;
+        pRecord->mpuCtrl = 0;
+    }
+    if (regions != 0)
+    {
+        uint32_t rnr = MPU_RNR;
+        for (uint32_t i = 0; (i < regions) && (i < CMX_MPU_REGIONS); i++)
+        {
+            MPU_RNR = i;
+            pRecord->mpuRbar[i] = MPU_RBAR;
+            pRecord->mpuRasr[i] = MPU_RASR;
+        }
+        MPU_RNR = rnr;
+    }
+
+    // Measure the unused space left on each registered stack.  If the
+    // guard words at the bottom were overwritten the stack overflowed.
+    pRecord->numStacks = (g_numStacks < CMX_MAX_STACKS) ? g_numStacks
+                                                        : CMX_MAX_STACKS;
+    pRecord->stackOverflow = 0;
+    for (uint32_t i = 0; i < pRecord->numStacks; i++)
+    {
+        pRecord->stackHeadroom[i] = CMx_StackHeadroom(g_pStacks[i].base,
+                                                      g_pStacks[i].size);
+        if (pRecord->stackHeadroom[i] < (CMX_STACK_GUARD_WORDS * 4))
+        {
+            pRecord->stackOverflow |= 1U << i;
+        }
+    }
+
+    // Check the heap if the application provided a way to walk it
+    pRecord->heapStatus = CMX_HEAP_NOT_CHECKED;
+    if (g_pHeapAdapter != 0)
+    {
+        HeapCheck(pRecord);
+    }
+
+    // Now that everything is known, work out how serious the fault is
+    CMx_FaultClassify(pRecord);
+
+    // Copy the instruction halfwords leading up to and including the
+    // stacked PC so the faulting instruction (and a few before it) can be
+    // disassembled or replayed later.  Don't do this if the fault was on
+    // the instruction fetch itself or if the PC is outside of the code
+    // area, since reading it would just fault again.  If there was an
+    // error pushing or popping the frame the stacked PC is not valid at
+    // all.  The range check is done on the offset from CMX_CODE_START so
+    // it also works when that is 0.
+    pRecord->codeAddr = 0;
+#ifdef CMX_CODE_START
+    uint32_t pc = pRecord->frame[6] & ~1U;
+    uint32_t codeAddr = pc - ((CMX_CODE_HALFWORDS - 2) * 2);
+    uint32_t codeLimit = (uint32_t)(CMX_CODE_END - CMX_CODE_START)
+                       - (CMX_CODE_HALFWORDS * 2);
+    if (!(pRecord->cfsr & (NVIC_CFSR_IACCVIOL | NVIC_CFSR_IBUSERR | NVIC_CFSR_INVPC
+                         | NVIC_CFSR_STKERR | NVIC_CFSR_MSTKERR
+                         | NVIC_CFSR_UNSTKERR | NVIC_CFSR_MUNSTKERR))
+     && (codeAddr < pc)
+     && ((codeAddr - (uint32_t)CMX_CODE_START) <= codeLimit))
     {
-        DbgPrintf("%08X ", pStackFrame[i]);
-    }
-    DbgPrintf("\n\n");
-
-    // Check the bits in the memory management fault register and print
-    // the names of any bits that are turned on.
-    DbgPrintf("MMFSR:");
-    if (cfsr & NVIC_CFSR_MMARVALID)     { DbgPrintf(" MMARVALID"); }
-    if (cfsr & NVIC_CFSR_MLSPERR)       { DbgPrintf(" MLSPERR"); }
-    if (cfsr & NVIC_CFSR_MSTKERR)       { DbgPrintf(" MSTKERR"); }
-    if (cfsr & NVIC_CFSR_MUNSTKERR)     { DbgPrintf(" MUNSTKERR"); }
-    if (cfsr & NVIC_CFSR_DACCVIOL)      { DbgPrintf(" DACCVIOL"); }
-    if (cfsr & NVIC_CFSR_IACCVIOL)      { DbgPrintf(" IACCVIOL"); }
-    DbgPrintf("\n");
-
-    // Print the value of the memory management fault address register.
-    // But this is only valid if the MMARVALID bit is active.
-    // If this is valid, then is should point to the memory access
-    // location that caused the fault.
-    DbgPrintf("MMFAR: %08X\n\n", mmfar);
-
-    // Check the bits in the bus fault register and print
-    // the names of any bits that are turned on.
-    DbgPrintf("BFSR: ");
-    if (cfsr & NVIC_CFSR_BFARVALID)     { DbgPrintf(" BFARVALID"); }
-    if (cfsr & NVIC_CFSR_LSPERR)        { DbgPrintf(" LSPERR"); }
-    if (cfsr & NVIC_CFSR_STKERR)        { DbgPrintf(" STKERR"); }
-    if (cfsr & NVIC_CFSR_UNSTKERR)      { DbgPrintf(" UNSTKERR"); }
-    if (cfsr & NVIC_CFSR_IMPRECISERR)   { DbgPrintf(" IMPRECISERR"); }
-    if (cfsr & NVIC_CFSR_PRECISERR)     { DbgPrintf(" PRECISERR"); }
-    if (cfsr & NVIC_CFSR_IBUSERR)       { DbgPrintf(" IBUSERR"); }
-    DbgPrintf("\n");
-
-    // Print the value of the bus fault address register.
-    // But this is only valid if the BFARVALID bit is active.
-    DbgPrintf("BFAR: %08X\n\n", bfar);
-
-    // Check the bits in the usage fault register and print
-    // the names of any bits that are turned on.
-    DbgPrintf("UFSR :");
-    if (cfsr & NVIC_CFSR_DIVBYZERO)     { DbgPrintf(" DIVBYZERO"); }
-    if (cfsr & NVIC_CFSR_UNALIGNED)     { DbgPrintf(" UNALIGNED"); }
-    if (cfsr & NVIC_CFSR_NOCP)          { DbgPrintf(" NOCP"); }
-    if (cfsr & NVIC_CFSR_INVPC)         { DbgPrintf(" INVPC"); }
-    if (cfsr & NVIC_CFSR_INVSTATE)      { DbgPrintf(" INVSTATE"); }
-    if (cfsr & NVIC_CFSR_UNDEFINSTR)    { DbgPrintf(" UNDEFINSTR"); }
-    DbgPrintf("\n\n");
-}
-
-/*
- * Hard fault handler that preserves exception stack frame.
+        pRecord->codeAddr = codeAddr;
+        for (uint32_t i = 0; i < CMX_CODE_HALFWORDS; i++)
+        {
+            pRecord->code[i] = CMX_READ16(codeAddr + (i * 2));
+        }
+    }
+#endif
+}
+
+/*
+ * Decision table for classifying faults.  The first row where any of the
+ * CFSR or HFSR bits match gives the class and severity.  The rows are in
+ * order from the most to the least serious cause, since several bits can
+ * be set at once.
+ */
+static const struct
+{
+    uint32_t cfsrBits;
+    uint32_t hfsrBits;
+    uint8_t faultClass;
+    uint8_t severity;
+} g_classTable[] =
+{
+    { 0, NVIC_HFSR_VECTTBL, CMX_CLASS_VECTOR, CMX_SEVERITY_CRITICAL },
+    { NVIC_CFSR_MSTKERR | NVIC_CFSR_MUNSTKERR | NVIC_CFSR_MLSPERR
+    | NVIC_CFSR_STKERR | NVIC_CFSR_UNSTKERR | NVIC_CFSR_LSPERR,
+      0, CMX_CLASS_STACK, CMX_SEVERITY_CRITICAL },
+    { NVIC_CFSR_INVPC | NVIC_CFSR_INVSTATE | NVIC_CFSR_IACCVIOL
+    | NVIC_CFSR_IBUSERR | NVIC_CFSR_UNDEFINSTR,
+      0, CMX_CLASS_CODE, CMX_SEVERITY_HIGH },
+    { NVIC_CFSR_DACCVIOL, 0, CMX_CLASS_MEMORY, CMX_SEVERITY_HIGH },
+    { NVIC_CFSR_PRECISERR | NVIC_CFSR_IMPRECISERR,
+      0, CMX_CLASS_BUS, CMX_SEVERITY_MEDIUM },
+    { NVIC_CFSR_NOCP, 0, CMX_CLASS_FPU, CMX_SEVERITY_MEDIUM },
+    { NVIC_CFSR_UNALIGNED, 0, CMX_CLASS_ALIGN, CMX_SEVERITY_LOW },
+    { NVIC_CFSR_DIVBYZERO, 0, CMX_CLASS_MATH, CMX_SEVERITY_LOW },
+    { 0, NVIC_HFSR_DEBUGEVT, CMX_CLASS_DEBUG, CMX_SEVERITY_INFO },
+};
+
+/*
+ * Classify a fault and give it a severity, so that the most important
+ * faults can be reported first.  This uses the decision table above and
+ * then adjusts for a few things that can't be seen from the status bits
+ * alone: an access near address 0 is a null pointer, an overflowed stack
+ * always wins, and a fault in an interrupt handler is one level more
+ * severe than the same fault in a thread.
+ *
+ * @param pRecord is the fault record, its faultClass and severity are set
  */
 void
-CMx_FaultHandler(void)
+CMx_FaultClassify(tCMxFaultRecord *pRecord)
 {
-    // NOTE: I only tested the GCC version below.  I welcome corrections.
-    //
-    // The stack pointer needs to be preserved as soon as the fault handler
-    // is entered.  On entry the stack pointer points at the exception
-    // stack frame.  Then the decoder function can be called, passing the
-    // value of the stack pointer so that the decoder function can read
-    // register values off the stack.
-    //
-    // Note that you need to make sure your compiler is not being goofy
-    // here and pushing registers before the first instruction below is
-    // executed.  Using the gcc arm compiler seems okay.  I think the TI
-    // compiler pushes some stuff on the stack by default. If this happens
-    // then you will need to adjust the sp by the number of extra bytes
-    // that were pushed.  You can tell if this is a problem by looking at
-    // a listing of the assembly code emitted by your compiler.
-#if defined(__GNUC__)
-    __asm("    mov     r0, sp\n"
-          "    bl      CMx_FaultDecoder\n");
+    uint32_t faultClass = CMX_CLASS_UNKNOWN;
+    uint32_t severity = CMX_SEVERITY_HIGH;
 
-#elif defined(__CC_ARM)
-    // With the Keil/ARM compiler I think you can access SP directly
-    // without needing inline asm.  However you need to look at the
-    // generated disassembly and make sure it is not pushing any other
-    // stuff on the stack.
-    CMx_FaultDecoder(__current_sp());
+    for (uint32_t i = 0; i < (sizeof(g_classTable) / sizeof(g_classTable[0])); i++)
+    {
+        if ((pRecord->cfsr & g_classTable[i].cfsrBits)
+         || (pRecord->hfsr & g_classTable[i].hfsrBits))
+        {
+            faultClass = g_classTable[i].faultClass;
+            severity = g_classTable[i].severity;
+            break;
+        }
+    }
 
-#elif defined(__ICCARM__)
-    // My best guess for IAR.
-    __asm("    mov     r0, sp\n"
-          "    bl      CMx_FaultDecoder\n");
-#else
-#error Unrecognized toolchain in CMx_FaultHandler()
-#endif
-    // Hang
-    while(1)
+    // A data access with a valid address near 0 is a null pointer
+    uint32_t addr = 0xFFFFFFFF;
+    if (pRecord->cfsr & NVIC_CFSR_MMARVALID)
+    {
+        addr = pRecord->mmfar;
+    }
+    else if (pRecord->cfsr & NVIC_CFSR_BFARVALID)
+    {
+        addr = pRecord->bfar;
+    }
+    if (addr < CMX_NULL_LIMIT)
+    {
+        faultClass = CMX_CLASS_NULLPTR;
+        severity = CMX_SEVERITY_HIGH;
+    }
+
+    if (pRecord->stackOverflow != 0)
+    {
+        faultClass = CMX_CLASS_STACK;
+        severity = CMX_SEVERITY_CRITICAL;
+    }
+
+    if ((pRecord->excReturn != 0) && !(pRecord->excReturn & EXC_RETURN_THREAD)
+     && (severity < CMX_SEVERITY_CRITICAL))
+    {
+        severity++;
+    }
+
+    pRecord->faultClass = faultClass;
+    pRecord->severity = severity;
+}
+
+/*
+ * Find the MPU region that an address falls in, using the MPU
+ * configuration saved in a fault record.  When regions overlap the
+ * highest numbered region applies.  A region does not cover an address
+ * that is in one of its disabled subregions.
+ *
+ * @param pRecord is the captured fault information
+ * @param addr is the address to look up
+ *
+ * @return the region number, or -1 if the address is not in any enabled
+ * region (so the background region applies)
+ */
+int32_t
+CMx_FaultMpuMatch(const tCMxFaultRecord *pRecord, uint32_t addr)
+{
+    uint32_t regions = (pRecord->mpuType & MPU_TYPE_DREGION_M) >> MPU_TYPE_DREGION_S;
+    if (regions > CMX_MPU_REGIONS)
     {
+        regions = CMX_MPU_REGIONS;
     }
+
+    for (int32_t i = (int32_t)regions - 1; i >= 0; i--)
+    {
+        uint32_t rasr = pRecord->mpuRasr[i];
+        if (!(rasr & MPU_RASR_ENABLE))
+        {
+            continue;
+        }
+
+        // Region size is 2^(SIZE+1) bytes and the base is aligned to the
+        // size.  Compute the offset in the region so that a 4GB region
+        // does not overflow.
+        uint32_t sizeBits = ((rasr & MPU_RASR_SIZE_M) >> MPU_RASR_SIZE_S) + 1;
+        uint32_t mask = (sizeBits >= 32) ? 0xFFFFFFFF : ((1U << sizeBits) - 1);
+        if ((addr & ~mask) != (pRecord->mpuRbar[i] & ~mask))
+        {
+            continue;
+        }
+
+        // Regions of 256 bytes and larger are split in 8 subregions that
+        // can each be disabled
+        if (sizeBits >= 8)
+        {
+            uint32_t sub = (addr & mask) >> (sizeBits - 3);
+            uint32_t srd = (rasr & MPU_RASR_SRD_M) >> MPU_RASR_SRD_S;
+            if (srd & (1U << sub))
+            {
+                continue;
+            }
+        }
+        return i;
+    }
+    return -1;
+}
+
+/*
+ * Print through the output function of a decoder context, or DbgPrintf()
+ * if it does not have one.
+ */
+#define CtxPrintf(pCtx, ...)                                            \
+    (((pCtx)->pfnPrintf != 0) ? (pCtx)->pfnPrintf((pCtx)->pArg, __VA_ARGS__) \
+                              : DbgPrintf(__VA_ARGS__))
+
+/*
+ * Print which MPU region (or the background region) applies to the
+ * faulting address of a MemManage fault, and what its permissions are.
+ */
+static void
+DecodeMpu(const tCMxDecodeCtx *pCtx, const tCMxFaultRecord *pRecord)
+{
+    // Privileged and unprivileged permissions for each value of AP
+    static const char * const apText[8] =
+    {
+        "no access", "priv RW", "priv RW, unpriv RO", "full access",
+        "reserved", "priv RO", "RO", "RO"
+    };
+    uint32_t addr;
+
+    // For a data access violation the address is in MMFAR if it is valid,
+    // and for an instruction access violation it is the PC.
+    if (pRecord->cfsr & NVIC_CFSR_IACCVIOL)
+    {
+        addr = pRecord->frame[6];
+    }
+    else if (pRecord->cfsr & NVIC_CFSR_MMARVALID)
+    {
+        addr = pRecord->mmfar;
+    }
+    else
+    {
+        return;
+    }
+
+    if (!(pRecord->mpuCtrl & MPU_CTRL_ENABLE))
+    {
+        CtxPrintf(pCtx, "MPU: disabled, %08X is in the default memory map%s\n",
+                        addr, (addr >= 0x40000000) && ((addr < 0x60000000) || (addr >= 0xA0000000))
+                              ? " (execute never area)" : "");
+        return;
+    }
+
+    int32_t region = CMx_FaultMpuMatch(pRecord, addr);
+    if (region < 0)
+    {
+        CtxPrintf(pCtx, "MPU: %08X is not in any region, background %s\n", addr,
+                        (pRecord->mpuCtrl & MPU_CTRL_PRIVDEFENA)
+                        ? "map allows privileged access only" : "denies all access");
+        return;
+    }
+
+    uint32_t rasr = pRecord->mpuRasr[region];
+    uint32_t sizeBits = ((rasr & MPU_RASR_SIZE_M) >> MPU_RASR_SIZE_S) + 1;
+    uint32_t mask = (sizeBits >= 32) ? 0xFFFFFFFF : ((1U << sizeBits) - 1);
+    CtxPrintf(pCtx, "MPU: %08X is in region %d (%08X, 2^%u bytes), AP: %s%s\n",
+                    addr, region, pRecord->mpuRbar[region] & ~mask, sizeBits,
+                    apText[(rasr & MPU_RASR_AP_M) >> MPU_RASR_AP_S],
+                    (rasr & MPU_RASR_XN) ? ", XN" : "");
 }
+
+/* Names of the fault classes, for printing */
+static const char * const g_classNames[] =
+{
+    "unknown", "vector table", "stack", "code", "memory", "null pointer",
+    "bus", "FPU", "alignment", "math", "debug"
+};
+
+/*
+ * Print a captured fault record to the output of a decoder context.
+ * Nothing else is shared, so different threads of a host program can
+ * each decode records with their own context at the same time.
+ *
+ * @param pCtx is the decoder context
+ * @param pRecord is the fault information previously captured by
+ * CMx_FaultCapture()
+ */
+void
+CMx_FaultRecordDecodeCtx(const tCMxDecodeCtx *pCtx,
+                         const tCMxFaultRecord *pRecord)
+{
+    uint32_t cfsr = pRecord->cfsr;
+    uint32_t hfsr = pRecord->hfsr;
+
+    // In one of the dedicated fault handlers only the matching part of
+    // the fault status register is printed.  For a hard fault (or if the
+    // handler is not known) everything is printed.
+    bool showMem = true;
+    bool showBus = true;
+    bool showUsage = true;
+    switch (pRecord->exception)
+    {
+        case CMX_EXC_MEMMANAGE:
+            CtxPrintf(pCtx, "\n*** MemManage fault ***\n\n");
+            showBus = showUsage = false;
+            break;
+        case CMX_EXC_BUSFAULT:
+            CtxPrintf(pCtx, "\n*** BusFault ***\n\n");
+            showMem = showUsage = false;
+            break;
+        case CMX_EXC_USAGEFAULT:
+            CtxPrintf(pCtx, "\n*** UsageFault ***\n\n");
+            showMem = showBus = false;
+            break;
+        default:
+            CtxPrintf(pCtx, "\n*** Fault occurred ***\n\n");
+            break;
+    }
+    CtxPrintf(pCtx, "Time: %u  Build: %08X\n", pRecord->timestamp,
+              pRecord->buildId);
+    CtxPrintf(pCtx, "Class: %s  Severity: %u\n\n",
+                    (pRecord->faultClass < (sizeof(g_classNames) / sizeof(g_classNames[0])))
+                    ? g_classNames[pRecord->faultClass] : "?",
+                    pRecord->severity);
+
+    // Print the values of the 8 registers that were pushed in the
+    // exception stack frame.
+    CtxPrintf(pCtx, "Stack Frame\n----------\n");
+    CtxPrintf(pCtx, "   R0       R1       R2       R3      R12       LR       PC     xPSR\n");
+    //          XXXXXXXX XXXXXXXX XXXXXXXX XXXXXXXX XXXXXXXX XXXXXXXX XXXXXXXX XXXXXXXX
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        CtxPrintf(pCtx, "%08X ", pRecord->frame[i]);
+    }
+    CtxPrintf(pCtx, "\n\n");
+
+    // Show which stack the frame was on and what kind of frame it was.
+    // This is only known if the EXC_RETURN value was captured.
+    if (pRecord->excReturn != 0)
+    {
+        CtxPrintf(pCtx, "EXC_RETURN: %08X (%s, %s, %s frame)\n",
+                        pRecord->excReturn,
+                        (pRecord->excReturn & EXC_RETURN_THREAD) ? "Thread" : "Handler",
+                        (pRecord->excReturn & EXC_RETURN_PSP) ? "PSP" : "MSP",
+                        (pRecord->excReturn & EXC_RETURN_BASIC_FRAME) ? "basic" : "FPU");
+    }
+    CtxPrintf(pCtx, "SP: %08X%s\n\n", pRecord->sp,
+                    (pRecord->frame[7] & XPSR_STACK_ALIGN) ? " (padded)" : "");
+
+    // Print the special registers and the interrupt state
+    CtxPrintf(pCtx, "CONTROL  PRIMASK  BASEPRI  FAULTMSK MSP      PSP\n");
+    CtxPrintf(pCtx, "%08X %08X %08X %08X %08X %08X\n",
+                    pRecord->special.control, pRecord->special.primask,
+                    pRecord->special.basepri, pRecord->special.faultmask,
+                    pRecord->special.msp, pRecord->special.psp);
+    CtxPrintf(pCtx, "IRQ pending:");
+    for (uint32_t i = CMX_NVIC_WORDS; i > 0; i--)
+    {
+        CtxPrintf(pCtx, " %08X", pRecord->nvicPending[i - 1]);
+    }
+    CtxPrintf(pCtx, "\nIRQ active: ");
+    for (uint32_t i = CMX_NVIC_WORDS; i > 0; i--)
+    {
+        CtxPrintf(pCtx, " %08X", pRecord->nvicActive[i - 1]);
+    }
+    CtxPrintf(pCtx, "\n\n");
+
+    // Print the headroom left on each stack that was checked
+    for (uint32_t i = 0; i < pRecord->numStacks; i++)
+    {
+        CtxPrintf(pCtx, "Stack %u: %u bytes free%s\n", i, pRecord->stackHeadroom[i],
+                        (pRecord->stackOverflow & (1U << i)) ? " OVERFLOW" : "");
+    }
+    if (pRecord->numStacks != 0)
+    {
+        CtxPrintf(pCtx, "\n");
+    }
+
+    // Print the result of the heap check, if there was one
+    if (pRecord->heapStatus != CMX_HEAP_NOT_CHECKED)
+    {
+        if (pRecord->heapStatus == CMX_HEAP_CORRUPT)
+        {
+            CtxPrintf(pCtx, "Heap: CORRUPT block at %08X\n", pRecord->heapBadBlock);
+        }
+        else if (pRecord->heapStatus == CMX_HEAP_BUDGET)
+        {
+            CtxPrintf(pCtx, "Heap: stopped at %08X (out of time)\n",
+                            pRecord->heapBadBlock);
+        }
+        else
+        {
+            CtxPrintf(pCtx, "Heap: OK\n");
+        }
+        CtxPrintf(pCtx, "Heap blocks: %u used: %u free: %u largest free: %u\n\n",
+                        pRecord->heapBlocks, pRecord->heapUsed,
+                        pRecord->heapFree, pRecord->heapLargestFree);
+    }
+
+    // Print the instruction halfwords around the PC, if they were
+    // captured.  The halfword at the stacked PC is marked with '>'.
+    if (pRecord->codeAddr != 0)
+    {
+        CtxPrintf(pCtx, "Code @ %08X:", pRecord->codeAddr);
+        for (uint32_t i = 0; i < CMX_CODE_HALFWORDS; i++)
+        {
+            bool atPc = (pRecord->codeAddr + (i * 2)) == (pRecord->frame[6] & ~1U);
+            CtxPrintf(pCtx, "%s%04X", atPc ? " >" : " ", pRecord->code[i]);
+        }
+        CtxPrintf(pCtx, "\n\n");
+    }
+
+    // Check the bits in the hard fault status register.  FORCED means
+    // that one of the configurable faults below was escalated.
+    if (showMem && showBus && showUsage)
+    {
+        CtxPrintf(pCtx, "HFSR: ");
+        if (hfsr & NVIC_HFSR_DEBUGEVT)      { CtxPrintf(pCtx, " DEBUGEVT"); }
+        if (hfsr & NVIC_HFSR_FORCED)        { CtxPrintf(pCtx, " FORCED"); }
+        if (hfsr & NVIC_HFSR_VECTTBL)       { CtxPrintf(pCtx, " VECTTBL"); }
+        CtxPrintf(pCtx, "\n\n");
+    }
+
+    if (showMem)
+    {
+        // Check the bits in the memory management fault register and print
+        // the names of any bits that are turned on.
+        CtxPrintf(pCtx, "MMFSR:");
+        if (cfsr & NVIC_CFSR_MMARVALID)     { CtxPrintf(pCtx, " MMARVALID"); }
+        if (cfsr & NVIC_CFSR_MLSPERR)       { CtxPrintf(pCtx, " MLSPERR"); }
+        if (cfsr & NVIC_CFSR_MSTKERR)       { CtxPrintf(pCtx, " MSTKERR"); }
+        if (cfsr & NVIC_CFSR_MUNSTKERR)     { CtxPrintf(pCtx, " MUNSTKERR"); }
+        if (cfsr & NVIC_CFSR_DACCVIOL)      { CtxPrintf(pCtx, " DACCVIOL"); }
+        if (cfsr & NVIC_CFSR_IACCVIOL)      { CtxPrintf(pCtx, " IACCVIOL"); }
+        CtxPrintf(pCtx, "\n");
+
+        // Print the value of the memory management fault address register.
+        // But this is only valid if the MMARVALID bit is active.
+        // If this is valid, then is should point to the memory access
+        // location that caused the fault.
+        CtxPrintf(pCtx, "MMFAR: %08X\n", pRecord->mmfar);
+
+        // Show the MPU region that was hit by an access violation
+        if (cfsr & (NVIC_CFSR_DACCVIOL | NVIC_CFSR_IACCVIOL))
+        {
+            DecodeMpu(pCtx, pRecord);
+        }
+        CtxPrintf(pCtx, "\n");
+    }
+
+    if (showBus)
+    {
+        // Check the bits in the bus fault register and print
+        // the names of any bits that are turned on.
+        CtxPrintf(pCtx, "BFSR: ");
+        if (cfsr & NVIC_CFSR_BFARVALID)     { CtxPrintf(pCtx, " BFARVALID"); }
+        if (cfsr & NVIC_CFSR_LSPERR)        { CtxPrintf(pCtx, " LSPERR"); }
+        if (cfsr & NVIC_CFSR_STKERR)        { CtxPrintf(pCtx, " STKERR"); }
+        if (cfsr & NVIC_CFSR_UNSTKERR)      { CtxPrintf(pCtx, " UNSTKERR"); }
+        if (cfsr & NVIC_CFSR_IMPRECISERR)   { CtxPrintf(pCtx, " IMPRECISERR"); }
+        if (cfsr & NVIC_CFSR_PRECISERR)     { CtxPrintf(pCtx, " PRECISERR"); }
+        if (cfsr & NVIC_CFSR_IBUSERR)       { CtxPrintf(pCtx, " IBUSERR"); }
+        CtxPrintf(pCtx, "\n");
+
+        // Print the value of the bus fault address register.
+        // But this is only valid if the BFARVALID bit is active.
+        CtxPrintf(pCtx, "BFAR: %08X\n\n", pRecord->bfar);
+    }
+
+    if (showUsage)
+    {
+        // Check the bits in the usage fault register and print
+        // the names of any bits that are turned on.
+        CtxPrintf(pCtx, "UFSR :");
+        if (cfsr & NVIC_CFSR_DIVBYZERO)     { CtxPrintf(pCtx, " DIVBYZERO"); }
+        if (cfsr & NVIC_CFSR_UNALIGNED)     { CtxPrintf(pCtx, " UNALIGNED"); }
+        if (cfsr & NVIC_CFSR_NOCP)          { CtxPrintf(pCtx, " NOCP"); }
+        if (cfsr & NVIC_CFSR_INVPC)         { CtxPrintf(pCtx, " INVPC"); }
+        if (cfsr & NVIC_CFSR_INVSTATE)      { CtxPrintf(pCtx, " INVSTATE"); }
+        if (cfsr & NVIC_CFSR_UNDEFINSTR)    { CtxPrintf(pCtx, " UNDEFINSTR"); }
+        CtxPrintf(pCtx, "\n\n");
+    }
+}
+
+/*
+ * Print a captured fault record with DbgPrintf().
+ *
+ * @param pRecord is the fault information previously captured by
+ * CMx_FaultCapture()
+ */
+void
+CMx_FaultRecordDecode(const tCMxFaultRecord *pRecord)
+{
+    static const tCMxDecodeCtx ctx = { 0, 0 };
+    CMx_FaultRecordDecodeCtx(&ctx, pRecord);
+}
+
+/*
+ * Enable or disable the dedicated MemManage, BusFault and UsageFault
+ * handlers.  When these are disabled, those faults escalate to a hard
+ * fault.  When enabled, the matching handler (CMx_MemManageHandler() and
+ * so on) must be in the vector table.  This is not available on ARMv6-M
+ * which only has the hard fault.
+ *
+ * @param faults is a combination of CMX_FAULT_MEMMANAGE, CMX_FAULT_BUS
+ * and CMX_FAULT_USAGE for the handlers to enable.  The others are
+ * disabled.
+ */
+void
+CMx_FaultHandlersEnable(uint32_t faults)
+{
+    uint32_t all = CMX_FAULT_MEMMANAGE | CMX_FAULT_BUS | CMX_FAULT_USAGE;
+    NVIC_SHCSR = (NVIC_SHCSR & ~all) | (faults & all);
+}
+
+/*
+ * FNV-1a hash of the words that make up a fault signature.
+ */
+static uint32_t
+SignatureHash(uint32_t pc, uint32_t lr, uint32_t cfsr, uint32_t hfsr)
+{
+    uint32_t words[4] = { pc, lr, cfsr, hfsr };
+    uint32_t hash = 0x811C9DC5;
+
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        for (uint32_t b = 0; b < 32; b += 8)
+        {
+            hash ^= (words[i] >> b) & 0xFF;
+            hash *= 0x01000193;
+        }
+    }
+    return hash;
+}
+
+#ifdef CMX_STABLE_SIGNATURE
+#if (CMX_STABLE_SIGNATURE_HALFWORDS > 8) \
+ || (CMX_STABLE_SIGNATURE_HALFWORDS > CMX_CODE_HALFWORDS)
+#error CMX_STABLE_SIGNATURE_HALFWORDS must be at most 8 and CMX_CODE_HALFWORDS
+#endif
+
+/* Code that is masked, the same as what a packed record holds */
+#if CMX_CODE_HALFWORDS < 8
+#define STABLE_CODE_HALFWORDS CMX_CODE_HALFWORDS
+#else
+#define STABLE_CODE_HALFWORDS 8
+#endif
+
+/*
+ * FNV-1a hash of the code leading up to and at the PC and the fault
+ * status registers.  Immediates that change when code or data moves are
+ * masked first: the offsets of BL and B.W, of PC relative LDR, and of
+ * ADR.  The masking is done over all of the code that a packed record
+ * holds, before the window is hashed, so that the window does not start
+ * in the middle of an instruction that was not masked.  The code itself
+ * can still start in the middle of an instruction, but the same code is
+ * always masked the same way.
+ *
+ * @param pCode is the last STABLE_CODE_HALFWORDS halfwords of the code
+ */
+static uint32_t
+StableSignature(const uint16_t *pCode, uint32_t cfsr, uint32_t hfsr)
+{
+    uint16_t code[STABLE_CODE_HALFWORDS];
+    uint32_t hash = 0x811C9DC5;
+
+    for (uint32_t i = 0; i < STABLE_CODE_HALFWORDS; i++)
+    {
+        code[i] = pCode[i];
+    }
+    for (uint32_t i = 0; i < STABLE_CODE_HALFWORDS; i++)
+    {
+        uint16_t op = code[i];
+        if ((CMx_ThumbInstrLen(op) == 4) && ((i + 1) < STABLE_CODE_HALFWORDS))
+        {
+            uint16_t op2 = code[i + 1];
+            if (((op & 0xF800) == 0xF000) && ((op2 & 0x9000) == 0x9000))
+            {
+                code[i] = 0xF000;
+                code[i + 1] = op2 & 0xD000;
+            }
+            else if ((op & 0xFF7F) == 0xF85F)
+            {
+                code[i + 1] = op2 & 0xF000;
+            }
+            i++;
+        }
+        else if (((op & 0xF800) == 0x4800) || ((op & 0xF800) == 0xA000))
+        {
+            code[i] = op & 0xFF00;
+        }
+    }
+
+    for (uint32_t i = STABLE_CODE_HALFWORDS - CMX_STABLE_SIGNATURE_HALFWORDS;
+         i < STABLE_CODE_HALFWORDS; i++)
+    {
+        hash ^= code[i] & 0xFF;
+        hash *= 0x01000193;
+        hash ^= code[i] >> 8;
+        hash *= 0x01000193;
+    }
+    return SignatureHash(hash, 0, cfsr, hfsr);
+}
+#endif
+
+/*
+ * Compute a signature for a fault.  Faults with the same signature are
+ * assumed to be the same fault occurring again.  This is an FNV-1a hash
+ * of the stacked PC and LR and the fault status registers.
+ *
+ * If CMX_STABLE_SIGNATURE is defined and the code at the PC was captured,
+ * the last CMX_STABLE_SIGNATURE_HALFWORDS halfwords of code are hashed
+ * instead of the PC and LR (see STABLE SIGNATURES).
+ *
+ * @param pRecord is the captured fault information
+ *
+ * @return the 32-bit fault signature
+ */
+uint32_t
+CMx_FaultSignature(const tCMxFaultRecord *pRecord)
+{
+#ifdef CMX_STABLE_SIGNATURE
+    if (pRecord->codeAddr != 0)
+    {
+        return StableSignature(&pRecord->code[CMX_CODE_HALFWORDS
+                                              - STABLE_CODE_HALFWORDS],
+                               pRecord->cfsr, pRecord->hfsr);
+    }
+#endif
+    return SignatureHash(pRecord->frame[6], pRecord->frame[5], pRecord->cfsr,
+                         pRecord->hfsr);
+}
+
+/*
+ * Write a value to a buffer as a varint: 7 bits per byte, low bits
+ * first, with the top bit set on all but the last byte.
+ *
+ * @return the number of bytes written (1 to 5)
+ */
+static uint32_t
+VarintPut(uint8_t *pBuf, uint32_t value)
+{
+    uint32_t len = 0;
+
+    while (value >= 0x80)
+    {
+        pBuf[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    pBuf[len++] = (uint8_t)value;
+    return len;
+}
+
+/*
+ * Read a varint from a buffer.
+ *
+ * @return the number of bytes used, or 0 if the buffer ran out
+ */
+static uint32_t
+VarintGet(const uint8_t *pBuf, uint32_t size, uint32_t *pValue)
+{
+    uint32_t value = 0;
+
+    for (uint32_t i = 0; (i < size) && (i < 5); i++)
+    {
+        value |= (uint32_t)(pBuf[i] & 0x7F) << (i * 7);
+        if (!(pBuf[i] & 0x80))
+        {
+            *pValue = value;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Copy a field into a packed record and mark it present.
+ */
+static void
+RecordPut(uint32_t *pBuf, uint32_t field, uint32_t offset,
+          const uint32_t *pValue, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        pBuf[offset + i] = pValue[i];
+    }
+    pBuf[2] |= 1UL << field;
+}
+
+/*
+ * Word offset of each field in a packed record, as <name>Offset.  These
+ * are enum constants so fields that a build does not pack (LOG without
+ * CMX_FAULT_LOG) don't leave an unused variable behind.
+ */
+#define CMX_RECORD_FIELD_OFFSET(id, name, offset, words) name##Offset = offset,
+enum
+{
+    CMX_RECORD_FIELDS(CMX_RECORD_FIELD_OFFSET)
+};
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+/*
+ * Pack a fault record into the versioned format described in the header,
+ * for sending it off the device.  Fields that were not captured are left
+ * out, so a reader sees them as missing and not as 0.  The code, MPU,
+ * NVIC and stack arrays have a fixed size in the packed record no matter
+ * how the decoder is configured.  If CMX_CODE_HALFWORDS is not 8, the 8
+ * halfwords that end at the same place are packed and the code address
+ * is adjusted to match.
+ *
+ * @param pRecord is the captured fault information
+ * @param pBuf is where to write the packed record, CMX_RECORD_WORDS long
+ *
+ * @return the size of the packed record in bytes
+ */
+uint32_t
+CMx_FaultRecordPack(const tCMxFaultRecord *pRecord, uint32_t *pBuf)
+{
+    for (uint32_t i = 0; i < CMX_RECORD_WORDS; i++)
+    {
+        pBuf[i] = 0;
+    }
+    pBuf[0] = CMX_RECORD_MAGIC;
+    pBuf[1] = (CMX_RECORD_VERSION << 16) | (CMX_RECORD_WORDS * 4);
+
+    RecordPut(pBuf, CMX_FIELD_TIMESTAMP, timestampOffset,
+              &pRecord->timestamp, 1);
+    RecordPut(pBuf, CMX_FIELD_BUILD_ID, buildIdOffset, &pRecord->buildId, 1);
+    RecordPut(pBuf, CMX_FIELD_CLASS, faultClassOffset,
+              &pRecord->faultClass, 1);
+    RecordPut(pBuf, CMX_FIELD_SEVERITY, severityOffset,
+              &pRecord->severity, 1);
+    RecordPut(pBuf, CMX_FIELD_FRAME, frameOffset, pRecord->frame, 8);
+    RecordPut(pBuf, CMX_FIELD_SP, spOffset, &pRecord->sp, 1);
+    RecordPut(pBuf, CMX_FIELD_EXCEPTION, exceptionOffset,
+              &pRecord->exception, 1);
+    RecordPut(pBuf, CMX_FIELD_CFSR, cfsrOffset, &pRecord->cfsr, 1);
+    RecordPut(pBuf, CMX_FIELD_HFSR, hfsrOffset, &pRecord->hfsr, 1);
+    RecordPut(pBuf, CMX_FIELD_MMFAR, mmfarOffset, &pRecord->mmfar, 1);
+    RecordPut(pBuf, CMX_FIELD_BFAR, bfarOffset, &pRecord->bfar, 1);
+    RecordPut(pBuf, CMX_FIELD_NVIC_PENDING, nvicPendingOffset,
+              pRecord->nvicPending, MIN(CMX_NVIC_WORDS, 8));
+    RecordPut(pBuf, CMX_FIELD_NVIC_ACTIVE, nvicActiveOffset,
+              pRecord->nvicActive, MIN(CMX_NVIC_WORDS, 8));
+
+    // EXC_RETURN and the special registers are only known when the fault
+    // came through one of the handlers in this file
+    if (pRecord->excReturn != 0)
+    {
+        uint32_t special[6] = { pRecord->special.control,
+                                pRecord->special.primask,
+                                pRecord->special.basepri,
+                                pRecord->special.faultmask,
+                                pRecord->special.psp,
+                                pRecord->special.msp };
+        RecordPut(pBuf, CMX_FIELD_EXC_RETURN, excReturnOffset,
+                  &pRecord->excReturn, 1);
+        RecordPut(pBuf, CMX_FIELD_SPECIAL, specialOffset, special, 6);
+    }
+
+    if (pRecord->codeAddr != 0)
+    {
+        uint32_t code[4] = { 0 };
+        for (int32_t i = 0; i < 8; i++)
+        {
+            int32_t src = i + CMX_CODE_HALFWORDS - 8;
+            if (src >= 0)
+            {
+                code[i / 2] |= (uint32_t)pRecord->code[src] << ((i & 1) * 16);
+            }
+        }
+        uint32_t codeAddr = pRecord->codeAddr + ((CMX_CODE_HALFWORDS - 8) * 2);
+        RecordPut(pBuf, CMX_FIELD_CODE_ADDR, codeAddrOffset, &codeAddr, 1);
+        RecordPut(pBuf, CMX_FIELD_CODE, codeOffset, code, 4);
+    }
+
+    // MPU type 0 means there is no MPU, but for bus and usage faults the
+    // MPU is not captured at all so it is left out
+    if ((pRecord->exception != CMX_EXC_BUSFAULT)
+     && (pRecord->exception != CMX_EXC_USAGEFAULT))
+    {
+        RecordPut(pBuf, CMX_FIELD_MPU_TYPE, mpuTypeOffset,
+                  &pRecord->mpuType, 1);
+    }
+    if (pRecord->mpuType != 0)
+    {
+        RecordPut(pBuf, CMX_FIELD_MPU_CTRL, mpuCtrlOffset,
+                  &pRecord->mpuCtrl, 1);
+        RecordPut(pBuf, CMX_FIELD_MPU_RBAR, mpuRbarOffset,
+                  pRecord->mpuRbar, MIN(CMX_MPU_REGIONS, 16));
+        RecordPut(pBuf, CMX_FIELD_MPU_RASR, mpuRasrOffset,
+                  pRecord->mpuRasr, MIN(CMX_MPU_REGIONS, 16));
+    }
+
+    if (pRecord->numStacks != 0)
+    {
+        RecordPut(pBuf, CMX_FIELD_NUM_STACKS, numStacksOffset,
+                  &pRecord->numStacks, 1);
+        RecordPut(pBuf, CMX_FIELD_STACK_OVERFLOW, stackOverflowOffset,
+                  &pRecord->stackOverflow, 1);
+        RecordPut(pBuf, CMX_FIELD_STACK_HEADROOM, stackHeadroomOffset,
+                  pRecord->stackHeadroom, MIN(CMX_MAX_STACKS, 8));
+    }
+
+    if (pRecord->heapStatus != CMX_HEAP_NOT_CHECKED)
+    {
+        uint32_t heap[6] = { pRecord->heapStatus, pRecord->heapBadBlock,
+                             pRecord->heapBlocks, pRecord->heapUsed,
+                             pRecord->heapFree, pRecord->heapLargestFree };
+        RecordPut(pBuf, CMX_FIELD_HEAP, heapOffset, heap, 6);
+    }
+
+    return CMX_RECORD_WORDS * 4;
+}
+
+/*
+ * Unpack a record written by CMx_FaultRecordPack(), for example on the
+ * host.  Fields that are not in the packed record are left 0.
+ *
+ * @param pBuf is the packed record
+ * @param pRecord is where to write the unpacked record
+ *
+ * @return true if pBuf is a packed record
+ */
+bool
+CMx_FaultRecordUnpack(const uint32_t *pBuf, tCMxFaultRecord *pRecord)
+{
+    if (pBuf[0] != CMX_RECORD_MAGIC)
+    {
+        return false;
+    }
+
+    uint8_t *pClear = (uint8_t *)pRecord;
+    for (uint32_t i = 0; i < sizeof(*pRecord); i++)
+    {
+        pClear[i] = 0;
+    }
+
+    pRecord->timestamp = CMx_Record_timestamp(pBuf, 0);
+    pRecord->buildId = CMx_Record_buildId(pBuf, 0);
+    pRecord->faultClass = CMx_Record_faultClass(pBuf, 0);
+    pRecord->severity = CMx_Record_severity(pBuf, 0);
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        pRecord->frame[i] = CMx_Record_frame(pBuf, i);
+    }
+    pRecord->excReturn = CMx_Record_excReturn(pBuf, 0);
+    pRecord->sp = CMx_Record_sp(pBuf, 0);
+    pRecord->exception = CMx_Record_exception(pBuf, 0);
+    pRecord->cfsr = CMx_Record_cfsr(pBuf, 0);
+    pRecord->hfsr = CMx_Record_hfsr(pBuf, 0);
+    pRecord->mmfar = CMx_Record_mmfar(pBuf, 0);
+    pRecord->bfar = CMx_Record_bfar(pBuf, 0);
+
+    if (CMx_Record_codeAddr(pBuf, 0) != 0)
+    {
+        for (int32_t i = 0; i < 8; i++)
+        {
+            int32_t dst = i + CMX_CODE_HALFWORDS - 8;
+            if (dst >= 0)
+            {
+                pRecord->code[dst] = CMx_Record_code(pBuf, i / 2)
+                                     >> ((i & 1) * 16);
+            }
+        }
+        pRecord->codeAddr = CMx_Record_codeAddr(pBuf, 0)
+                            - ((CMX_CODE_HALFWORDS - 8) * 2);
+    }
+
+    pRecord->mpuType = CMx_Record_mpuType(pBuf, 0);
+    pRecord->mpuCtrl = CMx_Record_mpuCtrl(pBuf, 0);
+    for (uint32_t i = 0; i < MIN(CMX_MPU_REGIONS, 16); i++)
+    {
+        pRecord->mpuRbar[i] = CMx_Record_mpuRbar(pBuf, i);
+        pRecord->mpuRasr[i] = CMx_Record_mpuRasr(pBuf, i);
+    }
+
+    pRecord->special.control = CMx_Record_special(pBuf, 0);
+    pRecord->special.primask = CMx_Record_special(pBuf, 1);
+    pRecord->special.basepri = CMx_Record_special(pBuf, 2);
+    pRecord->special.faultmask = CMx_Record_special(pBuf, 3);
+    pRecord->special.psp = CMx_Record_special(pBuf, 4);
+    pRecord->special.msp = CMx_Record_special(pBuf, 5);
+    for (uint32_t i = 0; i < MIN(CMX_NVIC_WORDS, 8); i++)
+    {
+        pRecord->nvicPending[i] = CMx_Record_nvicPending(pBuf, i);
+        pRecord->nvicActive[i] = CMx_Record_nvicActive(pBuf, i);
+    }
+
+    pRecord->numStacks = MIN(CMx_Record_numStacks(pBuf, 0), CMX_MAX_STACKS);
+    pRecord->stackOverflow = CMx_Record_stackOverflow(pBuf, 0);
+    for (uint32_t i = 0; i < MIN(CMX_MAX_STACKS, 8); i++)
+    {
+        pRecord->stackHeadroom[i] = CMx_Record_stackHeadroom(pBuf, i);
+    }
+
+    pRecord->heapStatus = CMx_Record_heap(pBuf, 0);
+    pRecord->heapBadBlock = CMx_Record_heap(pBuf, 1);
+    pRecord->heapBlocks = CMx_Record_heap(pBuf, 2);
+    pRecord->heapUsed = CMx_Record_heap(pBuf, 3);
+    pRecord->heapFree = CMx_Record_heap(pBuf, 4);
+    pRecord->heapLargestFree = CMx_Record_heap(pBuf, 5);
+    return true;
+}
+
+/*
+ * Get the version of the batch functions exported from a shared library
+ * build, so a caller can check it before using them.
+ *
+ * @return CMX_API_VERSION
+ */
+CMX_API uint32_t
+CMx_ApiVersion(void)
+{
+    return CMX_API_VERSION;
+}
+
+/*
+ * Get the next record from a buffer of packed records that are back to
+ * back, each taking its size from its header rounded up to a whole word.
+ *
+ * @return the record, or 0 at the end of the buffer or if it is not a
+ * packed record
+ */
+static const uint32_t *
+BatchNext(const uint32_t *pRecords, uint32_t words, uint32_t *pPos)
+{
+    uint32_t pos = *pPos;
+    if ((pos + CMX_RECORD_HEADER_WORDS) > words)
+    {
+        return 0;
+    }
+
+    const uint32_t *pBuf = &pRecords[pos];
+    uint32_t size = ((pBuf[1] & 0xFFFF) + 3) / 4;
+    if ((pBuf[0] != CMX_RECORD_MAGIC) || (size < CMX_RECORD_HEADER_WORDS)
+     || ((pos + size) > words))
+    {
+        return 0;
+    }
+    *pPos = pos + size;
+    return pBuf;
+}
+
+/*
+ * Decode a batch of packed records with one call.  The records are back
+ * to back in the buffer, each taking its size from its header rounded up
+ * to a whole word.  For each record the signature, class and severity
+ * are written to the caller's arrays.  Records from firmware that did
+ * not classify faults are classified here.  Decoding stops at the end of
+ * the buffer, at maxCount records, or at anything that is not a packed
+ * record.
+ *
+ * @param pRecords is the buffer of packed records
+ * @param words is the length of the buffer in words
+ * @param maxCount is the length of each of the output arrays
+ * @param pSignature is where to write the fault signatures
+ * @param pClass is where to write the fault classes, CMX_CLASS_xxx
+ * @param pSeverity is where to write the severities, CMX_SEVERITY_xxx
+ *
+ * @return the number of records decoded
+ */
+CMX_API uint32_t
+CMx_FaultBatchDecode(const uint32_t *pRecords, uint32_t words,
+                     uint32_t maxCount, uint32_t *pSignature,
+                     uint32_t *pClass, uint32_t *pSeverity)
+{
+    uint32_t count = 0;
+    uint32_t pos = 0;
+    const uint32_t *pBuf;
+
+    while ((count < maxCount)
+        && ((pBuf = BatchNext(pRecords, words, &pos)) != 0))
+    {
+        // The signature and the classification only depend on a few
+        // fields, so just those are read instead of unpacking the whole
+        // record.  Keep this in step with CMx_FaultSignature() and
+        // CMx_FaultClassify().
+        tCMxFaultRecord record;
+        record.frame[5] = CMx_Record_frame(pBuf, 5);
+        record.frame[6] = CMx_Record_frame(pBuf, 6);
+        record.cfsr = CMx_Record_cfsr(pBuf, 0);
+        record.hfsr = CMx_Record_hfsr(pBuf, 0);
+#ifdef CMX_STABLE_SIGNATURE
+        record.codeAddr = CMx_Record_codeAddr(pBuf, 0);
+        for (uint32_t i = 8 - STABLE_CODE_HALFWORDS; i < 8; i++)
+        {
+            record.code[CMX_CODE_HALFWORDS - 8 + i] =
+                CMx_Record_code(pBuf, i / 2) >> ((i & 1) * 16);
+        }
+#endif
+        if (pBuf[2] & (1UL << CMX_FIELD_CLASS))
+        {
+            record.faultClass = CMx_Record_faultClass(pBuf, 0);
+            record.severity = CMx_Record_severity(pBuf, 0);
+        }
+        else
+        {
+            record.mmfar = CMx_Record_mmfar(pBuf, 0);
+            record.bfar = CMx_Record_bfar(pBuf, 0);
+            record.stackOverflow = CMx_Record_stackOverflow(pBuf, 0);
+            record.excReturn = CMx_Record_excReturn(pBuf, 0);
+            CMx_FaultClassify(&record);
+        }
+        pSignature[count] = CMx_FaultSignature(&record);
+        pClass[count] = record.faultClass;
+        pSeverity[count] = record.severity;
+
+        count++;
+    }
+    return count;
+}
+
+/* Word offset and number of words of each packed record field */
+#define CMX_RECORD_FIELD_LAYOUT(id, name, offset, words) { offset, words },
+static const struct
+{
+    uint8_t offset;
+    uint8_t words;
+} g_recordLayout[CMX_FIELD_COUNT] =
+{
+    CMX_RECORD_FIELDS(CMX_RECORD_FIELD_LAYOUT)
+};
+
+/*
+ * Copy one field of every record in a batch into an array, so that later
+ * stages can work on just the columns they need (PC, CFSR, ...) instead
+ * of going through the whole record each time.  A field that a record
+ * does not have is 0.
+ *
+ * @param pRecords is the buffer of packed records
+ * @param words is the length of the buffer in words
+ * @param maxCount is the length of the column array
+ * @param field is the field to copy, CMX_FIELD_xxx
+ * @param index selects the word for a field with more than one word
+ * @param pColumn is where to write the field of each record
+ *
+ * @return the number of records copied
+ */
+CMX_API uint32_t
+CMx_FaultBatchColumn(const uint32_t *pRecords, uint32_t words,
+                     uint32_t maxCount, uint32_t field, uint32_t index,
+                     uint32_t *pColumn)
+{
+    uint32_t count = 0;
+    uint32_t pos = 0;
+    const uint32_t *pBuf;
+
+    if (field >= CMX_FIELD_COUNT)
+    {
+        return 0;
+    }
+    while ((count < maxCount)
+        && ((pBuf = BatchNext(pRecords, words, &pos)) != 0))
+    {
+        pColumn[count++] = CMx_RecordGet(pBuf, field,
+                                         g_recordLayout[field].offset,
+                                         g_recordLayout[field].words, index);
+    }
+    return count;
+}
+
+/*
+ * Find the records in a batch that are from one firmware build and in a
+ * time window, so that a query only has to look at those.  Records from
+ * before the build ID was in the packed record have a build ID of 0.
+ *
+ * @param pRecords is the buffer of packed records
+ * @param words is the length of the buffer in words
+ * @param maxCount is the length of the offset array
+ * @param buildId is the build to select
+ * @param timeStart is the start of the time window
+ * @param timeEnd is the end of the time window (not included)
+ * @param pOffsets is where to write the word offset of each record that
+ * was selected
+ *
+ * @return the number of records selected
+ */
+CMX_API uint32_t
+CMx_FaultBatchSelect(const uint32_t *pRecords, uint32_t words,
+                     uint32_t maxCount, uint32_t buildId,
+                     uint32_t timeStart, uint32_t timeEnd,
+                     uint32_t *pOffsets)
+{
+    uint32_t count = 0;
+    uint32_t pos = 0;
+    const uint32_t *pBuf;
+
+    while ((count < maxCount)
+        && ((pBuf = BatchNext(pRecords, words, &pos)) != 0))
+    {
+        uint32_t time = CMx_Record_timestamp(pBuf, 0);
+        if ((CMx_Record_buildId(pBuf, 0) == buildId)
+         && (time >= timeStart) && (time < timeEnd))
+        {
+            pOffsets[count++] = (uint32_t)(pBuf - pRecords);
+        }
+    }
+    return count;
+}
+
+/*
+ * Compute the fault signatures of a batch from columns of PC, LR, CFSR
+ * and HFSR, as made by CMx_FaultBatchColumn().  With CMX_STABLE_SIGNATURE
+ * the signature is made from the captured code, which is not in these
+ * columns, so nothing is written and 0 is returned.  Use
+ * CMx_FaultBatchDecode() for signatures in that case.
+ *
+ * @param pPc is the stacked PC of each fault
+ * @param pLr is the stacked LR of each fault
+ * @param pCfsr is the CFSR of each fault
+ * @param pHfsr is the HFSR of each fault
+ * @param count is the number of faults
+ * @param pSignature is where to write the signatures
+ *
+ * @return the number of signatures written, count or 0
+ */
+CMX_API uint32_t
+CMx_FaultBatchSignature(const uint32_t *pPc, const uint32_t *pLr,
+                        const uint32_t *pCfsr, const uint32_t *pHfsr,
+                        uint32_t count, uint32_t *pSignature)
+{
+#ifdef CMX_STABLE_SIGNATURE
+    (void)pPc;
+    (void)pLr;
+    (void)pCfsr;
+    (void)pHfsr;
+    (void)count;
+    (void)pSignature;
+    return 0;
+#else
+    for (uint32_t i = 0; i < count; i++)
+    {
+        pSignature[i] = SignatureHash(pPc[i], pLr[i], pCfsr[i], pHfsr[i]);
+    }
+    return count;
+#endif
+}
+
+/*
+ * Sift a value down a max-heap, for the heap sort in
+ * CMx_SignatureRollup().
+ */
+static void
+HeapSiftDown(uint32_t *pKeys, uint32_t start, uint32_t count)
+{
+    uint32_t root = start;
+    uint32_t value = pKeys[root];
+
+    while (((root * 2) + 1) < count)
+    {
+        uint32_t child = (root * 2) + 1;
+        if (((child + 1) < count) && (pKeys[child + 1] > pKeys[child]))
+        {
+            child++;
+        }
+        if (pKeys[child] <= value)
+        {
+            break;
+        }
+        pKeys[root] = pKeys[child];
+        root = child;
+    }
+    pKeys[root] = value;
+}
+
+/*
+ * Count how many times each signature occurs in a batch.  The signatures
+ * are sorted in place (heap sort, so no extra memory is needed) and
+ * reduced to one of each, with its count in pCount.  The result is a
+ * sorted run that can be combined with others by CMx_SignatureMerge().
+ *
+ * @param pSignature is the batch of signatures, replaced by the unique
+ * signatures in ascending order
+ * @param count is the number of signatures
+ * @param pCount is where to write the count of each unique signature,
+ * count entries long
+ *
+ * @return the number of unique signatures
+ */
+CMX_API uint32_t
+CMx_SignatureRollup(uint32_t *pSignature, uint32_t count, uint32_t *pCount)
+{
+    uint32_t unique = 0;
+
+    for (uint32_t i = count / 2; i-- > 0; )
+    {
+        HeapSiftDown(pSignature, i, count);
+    }
+    for (uint32_t end = count; end-- > 1; )
+    {
+        uint32_t top = pSignature[0];
+        pSignature[0] = pSignature[end];
+        pSignature[end] = top;
+        HeapSiftDown(pSignature, 0, end);
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if ((unique != 0) && (pSignature[unique - 1] == pSignature[i]))
+        {
+            pCount[unique - 1]++;
+        }
+        else
+        {
+            pSignature[unique] = pSignature[i];
+            pCount[unique] = 1;
+            unique++;
+        }
+    }
+    return unique;
+}
+
+/*
+ * Merge two sorted runs of signatures and counts, such as from
+ * CMx_SignatureRollup(), adding the counts of signatures that are in
+ * both.  The output may not overlap either input.
+ *
+ * @param pSigA and pCountA are the first run, numA long
+ * @param pSigB and pCountB are the second run, numB long
+ * @param pSigOut and pCountOut are where to write the merged run, which
+ * can be up to numA + numB long
+ *
+ * @return the length of the merged run
+ */
+CMX_API uint32_t
+CMx_SignatureMerge(const uint32_t *pSigA, const uint32_t *pCountA,
+                   uint32_t numA, const uint32_t *pSigB,
+                   const uint32_t *pCountB, uint32_t numB,
+                   uint32_t *pSigOut, uint32_t *pCountOut)
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t n = 0;
+
+    while ((a < numA) || (b < numB))
+    {
+        if ((b >= numB) || ((a < numA) && (pSigA[a] < pSigB[b])))
+        {
+            pSigOut[n] = pSigA[a];
+            pCountOut[n] = pCountA[a++];
+        }
+        else if ((a >= numA) || (pSigB[b] < pSigA[a]))
+        {
+            pSigOut[n] = pSigB[b];
+            pCountOut[n] = pCountB[b++];
+        }
+        else
+        {
+            pSigOut[n] = pSigA[a];
+            pCountOut[n] = pCountA[a++] + pCountB[b++];
+        }
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Build a dictionary for compressing packed records from a sample of
+ * them.  Each word of the dictionary is the value that word has in most
+ * of the records (a majority vote), so that the difference from the
+ * dictionary is 0 for most words of most records.
+ *
+ * @param pRecords is the buffer of sample records
+ * @param words is the length of the buffer in words
+ * @param pDict is where to write the dictionary, CMX_RECORD_WORDS long
+ *
+ * @return the number of records used
+ */
+CMX_API uint32_t
+CMx_RecordDictTrain(const uint32_t *pRecords, uint32_t words, uint32_t *pDict)
+{
+    uint32_t votes[CMX_RECORD_WORDS];
+    uint32_t count = 0;
+    uint32_t pos = 0;
+    const uint32_t *pBuf;
+
+    for (uint32_t i = 0; i < CMX_RECORD_WORDS; i++)
+    {
+        pDict[i] = 0;
+        votes[i] = 0;
+    }
+    while ((pBuf = BatchNext(pRecords, words, &pos)) != 0)
+    {
+        uint32_t size = MIN(((pBuf[1] & 0xFFFF) + 3) / 4, CMX_RECORD_WORDS);
+        for (uint32_t i = 0; i < size; i++)
+        {
+            if (votes[i] == 0)
+            {
+                pDict[i] = pBuf[i];
+                votes[i] = 1;
+            }
+            else if (pDict[i] == pBuf[i])
+            {
+                votes[i]++;
+            }
+            else
+            {
+                votes[i]--;
+            }
+        }
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Compress a packed record against a dictionary.  Each word is XORed with
+ * the same word of the dictionary.  The result is a varint of the number
+ * of words, then for each word that is not 0 after the XOR, a varint of
+ * how many 0 words came before it and a varint of its value.
+ *
+ * @param pRecord is the packed record
+ * @param pDict is the dictionary from CMx_RecordDictTrain()
+ * @param pOut is where to write the compressed record
+ * @param outSize is the size of pOut in bytes, CMX_RECORD_COMPRESSED_MAX
+ * is always enough for a record of this version
+ *
+ * @return the size of the compressed record in bytes, 0 if it did not
+ * fit
+ */
+CMX_API uint32_t
+CMx_RecordCompress(const uint32_t *pRecord, const uint32_t *pDict,
+                   uint8_t *pOut, uint32_t outSize)
+{
+    uint32_t words = ((pRecord[1] & 0xFFFF) + 3) / 4;
+    uint32_t len = 0;
+    uint32_t run = 0;
+
+    if (outSize < 5)
+    {
+        return 0;
+    }
+    len += VarintPut(&pOut[len], words);
+    for (uint32_t i = 0; i < words; i++)
+    {
+        uint32_t diff = pRecord[i] ^ ((i < CMX_RECORD_WORDS) ? pDict[i] : 0);
+        if (diff == 0)
+        {
+            run++;
+            continue;
+        }
+        if ((len + 10) > outSize)
+        {
+            return 0;
+        }
+        len += VarintPut(&pOut[len], run);
+        len += VarintPut(&pOut[len], diff);
+        run = 0;
+    }
+    return len;
+}
+
+/*
+ * Decompress a record made by CMx_RecordCompress() with the same
+ * dictionary.
+ *
+ * @param pIn is the compressed record
+ * @param inSize is the size of the compressed record in bytes
+ * @param pDict is the dictionary from CMx_RecordDictTrain()
+ * @param pRecord is where to write the packed record
+ * @param maxWords is the length of pRecord in words
+ *
+ * @return the length of the packed record in words, 0 if the compressed
+ * record is not valid or does not fit
+ */
+CMX_API uint32_t
+CMx_RecordDecompress(const uint8_t *pIn, uint32_t inSize,
+                     const uint32_t *pDict, uint32_t *pRecord,
+                     uint32_t maxWords)
+{
+    uint32_t words;
+    uint32_t pos = VarintGet(pIn, inSize, &words);
+    uint32_t i = 0;
+
+    if ((pos == 0) || (words > maxWords))
+    {
+        return 0;
+    }
+    while (pos < inSize)
+    {
+        uint32_t run;
+        uint32_t diff;
+        uint32_t n = VarintGet(&pIn[pos], inSize - pos, &run);
+        if (n == 0)
+        {
+            return 0;
+        }
+        pos += n;
+        n = VarintGet(&pIn[pos], inSize - pos, &diff);
+        if ((n == 0) || (run >= (words - i)))
+        {
+            return 0;
+        }
+        pos += n;
+        run += i;
+        for (; i < run; i++)
+        {
+            pRecord[i] = (i < CMX_RECORD_WORDS) ? pDict[i] : 0;
+        }
+        pRecord[i] = diff ^ ((i < CMX_RECORD_WORDS) ? pDict[i] : 0);
+        i++;
+    }
+    for (; i < words; i++)
+    {
+        pRecord[i] = (i < CMX_RECORD_WORDS) ? pDict[i] : 0;
+    }
+    return words;
+}
+
+/*
+ * Compute the second hash used for the Bloom filter bit positions.  The
+ * signature is run through the murmur3 finalizer so that it is not
+ * correlated with the first hash (the signature itself).
+ */
+static uint32_t
+BloomHash2(uint32_t signature)
+{
+    signature ^= signature >> 16;
+    signature *= 0x85EBCA6B;
+    signature ^= signature >> 13;
+    signature *= 0xC2B2AE35;
+    signature ^= signature >> 16;
+    return signature;
+}
+
+/*
+ * Add a fault signature to a Bloom filter.
+ *
+ * @param pBloom is the filter, the number of bits must be a power of 2
+ * and at least 32
+ * @param signature is the fault signature from CMx_FaultSignature()
+ */
+void
+CMx_FaultBloomAdd(tCMxFaultBloom *pBloom, uint32_t signature)
+{
+    // Bit positions use enhanced double hashing, where the step between
+    // positions also changes for each hash.
+    uint32_t h1 = signature;
+    uint32_t h2 = BloomHash2(signature);
+
+    for (uint32_t i = 0; i < pBloom->numHashes; i++)
+    {
+        uint32_t bit = h1 & (pBloom->numBits - 1);
+        pBloom->pBits[bit / 32] |= 1U << (bit % 32);
+        h1 += h2;
+        h2 += i;
+    }
+}
+
+/*
+ * Check if a fault signature is in a Bloom filter.
+ *
+ * @param pBloom is the filter
+ * @param signature is the fault signature from CMx_FaultSignature()
+ *
+ * @return true if the signature is probably in the filter, false if it
+ * definitely is not
+ */
+bool
+CMx_FaultBloomCheck(const tCMxFaultBloom *pBloom, uint32_t signature)
+{
+    uint32_t h1 = signature;
+    uint32_t h2 = BloomHash2(signature);
+
+    for (uint32_t i = 0; i < pBloom->numHashes; i++)
+    {
+        uint32_t bit = h1 & (pBloom->numBits - 1);
+        if (!(pBloom->pBits[bit / 32] & (1U << (bit % 32))))
+        {
+            return false;
+        }
+        h1 += h2;
+        h2 += i;
+    }
+    return true;
+}
+
+/* Filter of fault signatures that have already been triaged */
+static const tCMxFaultBloom *g_pKnownFaults;
+
+/*
+ * Register a Bloom filter of known fault signatures.  Faults that match
+ * the filter are summarized instead of fully decoded.  The number of bits
+ * must be a power of 2 and at least 32, or the bit positions would fall
+ * outside of the bit array, and there must be at least one hash, or every
+ * fault would match.  A filter that does not meet these is not used.
+ *
+ * @param pBloom is the filter of known faults, or NULL to remove it
+ *
+ * @return true if the filter was registered or removed, false if it is
+ * not valid (then no filter is used)
+ */
+bool
+CMx_FaultSetKnown(const tCMxFaultBloom *pBloom)
+{
+    g_pKnownFaults = 0;
+    if (pBloom == 0)
+    {
+        return true;
+    }
+    if ((pBloom->pBits == 0) || (pBloom->numHashes == 0)
+     || (pBloom->numBits < 32)
+     || ((pBloom->numBits & (pBloom->numBits - 1)) != 0))
+    {
+        return false;
+    }
+    g_pKnownFaults = pBloom;
+    return true;
+}
+
+#ifdef CMX_FAULT_LOG
+/* Fault log is kept in memory that is not initialized at startup */
+#ifndef CMX_FAULT_LOG_ATTR
+#if defined(__GNUC__)
+#define CMX_FAULT_LOG_ATTR __attribute__((section(".noinit")))
+#else
+#define CMX_FAULT_LOG_ATTR
+#endif
+#endif
+
+static tCMxFaultLog g_faultLog CMX_FAULT_LOG_ATTR;
+
+/*
+ * Deltas between events can go backwards (for example a tick counter
+ * restarts after reset) so they are zigzag encoded to keep small
+ * negative values small.
+ */
+#define ZIGZAG_ENCODE(d) (((d) << 1) ^ (uint32_t)((int32_t)(d) >> 31))
+#define ZIGZAG_DECODE(z) (((z) >> 1) ^ (0U - ((z) & 1)))
+
+/*
+ * Decode one history event.  On entry the event holds the time and build
+ * ID of the previous event, and on return it holds this one.
+ *
+ * @return the number of bytes used, or 0 if there is no complete event
+ */
+static uint32_t
+HistoryDecode(const uint8_t *pBuf, uint32_t size, tCMxFaultEvent *pEvent)
+{
+    uint32_t timeDelta;
+    uint32_t buildDelta;
+    uint32_t len;
+    uint32_t used;
+
+    len = VarintGet(pBuf, size, &timeDelta);
+    if (len == 0)
+    {
+        return 0;
+    }
+    used = VarintGet(&pBuf[len], size - len, &buildDelta);
+    if ((used == 0) || ((len + used + 4) > size))
+    {
+        return 0;
+    }
+    len += used;
+
+    pEvent->time += ZIGZAG_DECODE(timeDelta);
+    pEvent->buildId += ZIGZAG_DECODE(buildDelta);
+    pEvent->signature = (uint32_t)pBuf[len]
+                      | ((uint32_t)pBuf[len + 1] << 8)
+                      | ((uint32_t)pBuf[len + 2] << 16)
+                      | ((uint32_t)pBuf[len + 3] << 24);
+    return len + 4;
+}
+
+/*
+ * Largest encoded history event: two 5 byte varints and the signature.
+ * The history has to hold at least one, or appending would overflow it.
+ */
+#define HISTORY_EVENT_MAX 14
+#if CMX_FAULT_HISTORY_BYTES < HISTORY_EVENT_MAX
+#error "CMX_FAULT_HISTORY_BYTES must be at least 14"
+#endif
+
+/*
+ * Append an event to the fault history.  Each event is stored as the
+ * zigzag varint time and build ID differences from the previous event,
+ * followed by the 4 byte signature.  That is usually 6 bytes.  If there
+ * is no room, the oldest events are dropped.
+ */
+static void
+HistoryAppend(tCMxFaultLog *pLog, uint32_t time, uint32_t buildId,
+              uint32_t signature)
+{
+    uint8_t event[HISTORY_EVENT_MAX];
+    uint32_t len = 0;
+
+    len += VarintPut(&event[len], ZIGZAG_ENCODE(time - pLog->histLastTime));
+    len += VarintPut(&event[len], ZIGZAG_ENCODE(buildId - pLog->histLastBuild));
+    for (uint32_t b = 0; b < 32; b += 8)
+    {
+        event[len++] = (uint8_t)(signature >> b);
+    }
+
+    // Drop events from the front until the new one fits.  The base time
+    // and build ID move forward to the dropped event so the remaining
+    // differences still add up.
+    while ((pLog->histLen + len) > CMX_FAULT_HISTORY_BYTES)
+    {
+        tCMxFaultEvent first = { pLog->histBaseTime, pLog->histBaseBuild, 0 };
+        uint32_t drop = HistoryDecode(pLog->history, pLog->histLen, &first);
+        if (drop == 0)
+        {
+            pLog->histLen = 0;
+            break;
+        }
+        pLog->histBaseTime = first.time;
+        pLog->histBaseBuild = first.buildId;
+        pLog->histLen -= drop;
+        for (uint32_t i = 0; i < pLog->histLen; i++)
+        {
+            pLog->history[i] = pLog->history[i + drop];
+        }
+    }
+    if (pLog->histLen == 0)
+    {
+        pLog->histBaseTime = pLog->histLastTime;
+        pLog->histBaseBuild = pLog->histLastBuild;
+    }
+
+    for (uint32_t i = 0; i < len; i++)
+    {
+        pLog->history[pLog->histLen + i] = event[i];
+    }
+    pLog->histLen += len;
+    pLog->histLastTime = time;
+    pLog->histLastBuild = buildId;
+}
+
+/*
+ * Get the retained fault log.  The first time after power-up the log
+ * memory has random contents, so it is cleared if it does not look valid.
+ * It is also cleared if it was written by firmware that lays it out
+ * differently.
+ *
+ * @return pointer to the fault log
+ */
+tCMxFaultLog *
+CMx_FaultLogGet(void)
+{
+    if ((g_faultLog.magic != CMX_FAULT_LOG_MAGIC)
+     || (g_faultLog.layout != LOG_LAYOUT(g_faultLog))
+     || (g_faultLog.config != LOG_CONFIG)
+     || (g_faultLog.histLen > CMX_FAULT_HISTORY_BYTES))
+    {
+        CMx_FaultLogClear();
+    }
+    return &g_faultLog;
+}
+
+/*
+ * Clear all entries from the retained fault log.  The application can
+ * call this after the logged faults have been reported.
+ */
+void
+CMx_FaultLogClear(void)
+{
+    uint8_t *pBytes = (uint8_t *)&g_faultLog;
+
+    for (uint32_t i = 0; i < sizeof(g_faultLog); i++)
+    {
+        pBytes[i] = 0;
+    }
+    g_faultLog.layout = LOG_LAYOUT(g_faultLog);
+    g_faultLog.config = LOG_CONFIG;
+    g_faultLog.magic = CMX_FAULT_LOG_MAGIC;
+}
+
+/*
+ * Add a fault to the retained fault log.  If a fault with the same
+ * signature is already in the log then just its counts are increased (and
+ * it has to be sent again), with the storm window restarted if it has
+ * passed.  Otherwise the record is saved in an empty
+ * slot, or if the log is full it replaces an entry that was already sent,
+ * or else the least severe entry and the oldest of those.  If every entry
+ * is unsent and more severe than the new fault, the new fault is only
+ * counted in the history.
+ *
+ * @param pRecord is the captured fault information
+ *
+ * @return the log entry for the fault, or NULL if it was not saved
+ */
+tCMxFaultLogEntry *
+CMx_FaultLogAdd(const tCMxFaultRecord *pRecord)
+{
+    tCMxFaultLog *pLog = CMx_FaultLogGet();
+    uint32_t signature = CMx_FaultSignature(pRecord);
+    tCMxFaultLogEntry *pEntry;
+
+    pLog->total++;
+
+    // Every fault goes in the history, even repeats
+    HistoryAppend(pLog, pRecord->timestamp, pRecord->buildId, signature);
+
+    // Look for a previous occurrence of the same fault
+    for (uint32_t i = 0; i < CMX_FAULT_LOG_ENTRIES; i++)
+    {
+        pEntry = &pLog->entries[i];
+        if ((pEntry->count != 0) && (pEntry->signature == signature))
+        {
+            pEntry->count++;
+            pEntry->sent = false;
+            if ((pRecord->timestamp - pEntry->windowStart) >= CMX_FAULT_STORM_WINDOW)
+            {
+                pEntry->windowStart = pRecord->timestamp;
+                pEntry->windowCount = 0;
+            }
+            pEntry->windowCount++;
+            return pEntry;
+        }
+    }
+
+    // This is a new fault, so find the slot to put it in.  An entry that
+    // was already sent is replaced before one that was not, whatever the
+    // severity.  Then the least severe, and the oldest of those.
+    pEntry = &pLog->entries[0];
+    for (uint32_t i = 1; (i < CMX_FAULT_LOG_ENTRIES) && (pEntry->count != 0); i++)
+    {
+        tCMxFaultLogEntry *pSlot = &pLog->entries[i];
+        if ((pSlot->count == 0)
+         || (pSlot->sent && !pEntry->sent)
+         || ((pSlot->sent == pEntry->sent)
+          && ((pSlot->record.severity < pEntry->record.severity)
+           || ((pSlot->record.severity == pEntry->record.severity)
+            && (pSlot->seq < pEntry->seq)))))
+        {
+            pEntry = pSlot;
+        }
+    }
+
+    // Don't lose a fault that hasn't been sent for a less severe one.  The
+    // new fault is still in the history.
+    if ((pEntry->count != 0) && !pEntry->sent
+     && (pEntry->record.severity > pRecord->severity))
+    {
+        return 0;
+    }
+    pEntry->signature = signature;
+    pEntry->count = 1;
+    pEntry->seq = pLog->total;
+    pEntry->windowStart = pRecord->timestamp;
+    pEntry->windowCount = 1;
+    pEntry->sent = false;
+    pEntry->record = *pRecord;
+    return pEntry;
+}
+
+/*
+ * Get the next fault log entry that should be sent off the device.  This
+ * is the most severe entry that hasn't been sent yet, and the oldest of
+ * those if there is more than one.  Call CMx_FaultLogMarkSent() once it
+ * has been sent.
+ *
+ * @return the entry to send, or NULL if everything was sent
+ */
+tCMxFaultLogEntry *
+CMx_FaultLogNextToSend(void)
+{
+    tCMxFaultLog *pLog = CMx_FaultLogGet();
+    tCMxFaultLogEntry *pBest = 0;
+
+    for (uint32_t i = 0; i < CMX_FAULT_LOG_ENTRIES; i++)
+    {
+        tCMxFaultLogEntry *pEntry = &pLog->entries[i];
+        if ((pEntry->count == 0) || pEntry->sent)
+        {
+            continue;
+        }
+        if ((pBest == 0)
+         || (pEntry->record.severity > pBest->record.severity)
+         || ((pEntry->record.severity == pBest->record.severity)
+          && (pEntry->seq < pBest->seq)))
+        {
+            pBest = pEntry;
+        }
+    }
+    return pBest;
+}
+
+/*
+ * Mark a fault log entry as sent.  It stays in the log (so repeats are
+ * still counted) but it is the first to be replaced by a new fault.
+ *
+ * @param pEntry is the entry from CMx_FaultLogNextToSend()
+ */
+void
+CMx_FaultLogMarkSent(tCMxFaultLogEntry *pEntry)
+{
+    pEntry->sent = true;
+}
+
+/*
+ * Pack a fault log entry for sending, like CMx_FaultRecordPack() but with
+ * the LOG field added so the receiver can tell if it has already seen
+ * this entry (see SENDING THE FAULT LOG).
+ *
+ * @param pEntry is the entry from CMx_FaultLogNextToSend()
+ * @param pBuf is where to write the packed record, CMX_RECORD_WORDS long
+ *
+ * @return the size of the packed record in bytes
+ */
+uint32_t
+CMx_FaultLogEntryPack(const tCMxFaultLogEntry *pEntry, uint32_t *pBuf)
+{
+    uint32_t log[2] = { pEntry->seq, pEntry->count };
+    uint32_t size = CMx_FaultRecordPack(&pEntry->record, pBuf);
+
+    RecordPut(pBuf, CMX_FIELD_LOG, logOffset, log, 2);
+    return size;
+}
+
+/*
+ * Read the next event from the fault history.  Events are returned
+ * oldest first.  To read the whole history, start with *pOffset set to 0
+ * and keep calling with the same offset and event until this returns
+ * false.  The event is updated in place because each one is stored as a
+ * difference from the one before.  For a time range scan, just skip the
+ * events outside of the range.
+ *
+ * @param pLog is the fault log from CMx_FaultLogGet()
+ * @param pOffset is the position in the history, 0 to start
+ * @param pEvent is updated with the next event
+ *
+ * @return true if an event was read, false at the end of the history
+ */
+bool
+CMx_FaultHistoryRead(const tCMxFaultLog *pLog, uint32_t *pOffset,
+                     tCMxFaultEvent *pEvent)
+{
+    if (*pOffset == 0)
+    {
+        pEvent->time = pLog->histBaseTime;
+        pEvent->buildId = pLog->histBaseBuild;
+    }
+    uint32_t len = HistoryDecode(&pLog->history[*pOffset],
+                                 pLog->histLen - *pOffset, pEvent);
+    *pOffset += len;
+    return len != 0;
+}
+#endif
+
+#ifdef CMX_FAULT_SHARED_LOG
+
+/*
+ * Claiming a slot in the shared log has to be atomic across cores.  On
+ * ARMv7-M this uses exclusive load and store.  ARMv6-M doesn't have those
+ * so you must provide a lock, for example a hardware spinlock.
+ */
+#if defined(__ARM_ARCH_6M__) || defined(__ARM_ARCH_8M_BASE__)
+#if !defined(CMX_SHARED_LOCK) || !defined(CMX_SHARED_UNLOCK)
+#error CMX_SHARED_LOCK() and CMX_SHARED_UNLOCK() are needed for the shared fault log on ARMv6-M
+#endif
+#endif
+
+/* Memory barrier so a slot is filled in before it is marked valid */
+#if defined(__GNUC__)
+#define SharedBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#elif defined(__ICCARM__)
+#define SharedBarrier() __DMB()
+#elif defined(__CC_ARM)
+#define SharedBarrier() __dmb(0xF)
+#endif
+
+/*
+ * The shared log is either at a fixed address that all cores agree on
+ * (CMX_FAULT_SHARED_ADDR, for parts where each core has its own image),
+ * or a variable placed in a section that is not initialized at startup.
+ */
+#ifdef CMX_FAULT_SHARED_ADDR
+#define g_sharedLog (*((volatile tCMxFaultSharedLog *)(CMX_FAULT_SHARED_ADDR)))
+#else
+#ifndef CMX_FAULT_SHARED_ATTR
+#if defined(__GNUC__)
+#define CMX_FAULT_SHARED_ATTR __attribute__((section(".noinit.shared")))
+#else
+#define CMX_FAULT_SHARED_ATTR
+#endif
+#endif
+static volatile tCMxFaultSharedLog g_sharedLog CMX_FAULT_SHARED_ATTR;
+#endif
+
+/*
+ * Atomically get the next sequence number of the shared log.
+ */
+static uint32_t
+SharedClaim(void)
+{
+    uint32_t seq;
+
+#if defined(CMX_SHARED_LOCK)
+    CMX_SHARED_LOCK();
+    seq = g_sharedLog.next++;
+    CMX_SHARED_UNLOCK();
+#elif defined(__GNUC__)
+    seq = __atomic_fetch_add(&g_sharedLog.next, 1, __ATOMIC_SEQ_CST);
+#elif defined(__ICCARM__)
+    do
+    {
+        seq = __LDREX((unsigned long *)&g_sharedLog.next);
+    } while (__STREX(seq + 1, (unsigned long *)&g_sharedLog.next));
+#elif defined(__CC_ARM)
+    do
+    {
+        seq = __ldrex(&g_sharedLog.next);
+    } while (__strex(seq + 1, &g_sharedLog.next));
+#endif
+    return seq;
+}
+
+/*
+ * Check that the shared log was initialized, by code that lays it out
+ * the same way.
+ */
+static bool
+SharedLogValid(void)
+{
+    return (g_sharedLog.magic == CMX_FAULT_LOG_MAGIC)
+        && (g_sharedLog.layout == LOG_LAYOUT(g_sharedLog))
+        && (g_sharedLog.config == LOG_CONFIG);
+}
+
+/*
+ * Initialize the shared fault log if it does not look valid.  Only one
+ * core should call this, at startup, before the other cores are started.
+ * It also counts the boot, so that faults from before this reset are
+ * not taken to be related to new ones.
+ *
+ * @param clear is true to clear the log even if it is valid
+ */
+void
+CMx_FaultSharedLogInit(bool clear)
+{
+    if (clear || !SharedLogValid())
+    {
+        volatile uint8_t *pBytes = (volatile uint8_t *)&g_sharedLog;
+        for (uint32_t i = 0; i < sizeof(g_sharedLog); i++)
+        {
+            pBytes[i] = 0;
+        }
+        g_sharedLog.layout = LOG_LAYOUT(g_sharedLog);
+        g_sharedLog.config = LOG_CONFIG;
+        SharedBarrier();
+        g_sharedLog.magic = CMX_FAULT_LOG_MAGIC;
+    }
+    g_sharedLog.boot++;
+    SharedBarrier();
+}
+
+/*
+ * Get the shared fault log, so that it can be read back after a reset.
+ * Valid entries have a non-zero sequence number and the entry with the
+ * highest sequence number is the most recent.
+ *
+ * @return pointer to the shared log
+ */
+const volatile tCMxFaultSharedLog *
+CMx_FaultSharedLogGet(void)
+{
+    return &g_sharedLog;
+}
+
+/*
+ * Add a fault to the shared fault log.  The slot is claimed atomically so
+ * several cores can fault at the same time.  While the record is being
+ * copied the sequence number in the slot is 0, so a reader never sees a
+ * partial record as valid.  The log is a ring so the oldest entries are
+ * replaced.
+ *
+ * @param pRecord is the captured fault information
+ *
+ * @return the index of the slot used, or -1 if the log was never
+ * initialized
+ */
+int32_t
+CMx_FaultSharedLogAdd(const tCMxFaultRecord *pRecord)
+{
+    if (!SharedLogValid())
+    {
+        return -1;
+    }
+
+    uint32_t seq = SharedClaim();
+    uint32_t slot = seq % CMX_FAULT_SHARED_ENTRIES;
+    volatile tCMxFaultSharedEntry *pEntry = &g_sharedLog.entries[slot];
+
+    pEntry->seq = 0;
+    SharedBarrier();
+    pEntry->coreId = CMX_CORE_ID();
+    pEntry->boot = g_sharedLog.boot;
+    const uint32_t *pSrc = (const uint32_t *)pRecord;
+    volatile uint32_t *pDst = (volatile uint32_t *)&pEntry->record;
+    for (uint32_t i = 0; i < (sizeof(*pRecord) / 4); i++)
+    {
+        pDst[i] = pSrc[i];
+    }
+    SharedBarrier();
+    pEntry->seq = seq + 1;
+    return (int32_t)slot;
+}
+
+/*
+ * Print any faults in the shared log from other cores that happened
+ * within a time window of a given entry.  This only makes sense if the
+ * time source is a clock that all of the cores share.  Entries from
+ * before the last reset are skipped, since a tick count time source
+ * starts again at 0 and they would look related.
+ *
+ * @param slot is the index of the entry to compare against
+ * @param window is the largest time difference to report
+ *
+ * @return the number of related faults found
+ */
+uint32_t
+CMx_FaultSharedCorrelate(uint32_t slot, uint32_t window)
+{
+    volatile tCMxFaultSharedEntry *pThis = &g_sharedLog.entries[slot];
+    uint32_t found = 0;
+
+    for (uint32_t i = 0; i < CMX_FAULT_SHARED_ENTRIES; i++)
+    {
+        volatile tCMxFaultSharedEntry *pOther = &g_sharedLog.entries[i];
+        if ((pOther->seq == 0) || (pOther->coreId == pThis->coreId)
+         || (pOther->boot != pThis->boot))
+        {
+            continue;
+        }
+        uint32_t delta = pOther->record.timestamp - pThis->record.timestamp;
+        if (((int32_t)delta < 0))
+        {
+            delta = 0 - delta;
+        }
+        if (delta <= window)
+        {
+            DbgPrintf("Core %u also faulted (PC %08X CFSR %08X time %u)\n",
+                      pOther->coreId, pOther->record.frame[6],
+                      pOther->record.cfsr, pOther->record.timestamp);
+            found++;
+        }
+    }
+    return found;
+}
+#endif
+
+/*
+ * Get the length of a Thumb instruction from its first halfword.  If the
+ * top 5 bits are 0b11101, 0b11110 or 0b11111 it is the first half of a
+ * 32-bit Thumb-2 instruction, otherwise it is a 16-bit instruction.
+ *
+ * @param opcode is the first halfword of the instruction
+ *
+ * @return the instruction length in bytes, 2 or 4
+ */
+uint32_t
+CMx_ThumbInstrLen(uint16_t opcode)
+{
+    return ((opcode >> 11) >= 0x1D) ? 4 : 2;
+}
+
+/*
+ * Advance the stacked PC past the faulting instruction so that execution
+ * resumes with the next instruction when the exception returns.  If the
+ * instruction was in an IT block, the IT state in the stacked xPSR is
+ * also advanced, the same way the processor would have if the
+ * instruction had completed.
+ *
+ * @param pStackFrame points at the exception stack frame
+ * @param opcode is the first halfword of the faulting instruction
+ *
+ * @return the number of bytes the PC was advanced
+ */
+uint32_t
+CMx_FaultSkipInstruction(uint32_t *pStackFrame, uint16_t opcode)
+{
+    uint32_t len = CMx_ThumbInstrLen(opcode);
+    uint32_t xpsr = pStackFrame[7];
+
+    pStackFrame[6] += len;
+
+    // IT[1:0] are in xPSR bits 26:25 and IT[7:2] in bits 15:10.  If the
+    // low 3 bits of IT are 0 this was the last instruction of the block,
+    // otherwise the mask in the low 5 bits shifts along by one.
+    uint32_t it = ((xpsr >> 25) & 0x03) | ((xpsr >> 8) & 0xFC);
+    if (it != 0)
+    {
+        if ((it & 0x07) == 0)
+        {
+            it = 0;
+        }
+        else
+        {
+            it = (it & 0xE0) | ((it << 1) & 0x1F);
+        }
+        xpsr &= ~(XPSR_IT_LOW_M | XPSR_IT_HIGH_M);
+        xpsr |= ((it & 0x03) << 25) | ((it & 0xFC) << 8);
+        pStackFrame[7] = xpsr;
+    }
+    return len;
+}
+
+/* Application policy that decides if a fault can be recovered from */
+static tCMxFaultPolicy g_pfnFaultPolicy;
+
+/*
+ * Register a policy function that decides if execution should resume
+ * after a fault instead of hanging.  The function is called with the
+ * captured record after the fault has been printed.
+ *
+ * @param pfnPolicy returns true to resume after the faulting instruction,
+ * or NULL to always hang
+ */
+void
+CMx_FaultSetPolicy(tCMxFaultPolicy pfnPolicy)
+{
+    g_pfnFaultPolicy = pfnPolicy;
+}
+
+/*
+ * Check the recovery policy and if the fault can be recovered from, set
+ * up the stack frame so that execution continues after the faulting
+ * instruction.
+ *
+ * @return true if the fault handler should return
+ */
+static bool
+FaultResume(uint32_t *pStackFrame, const tCMxFaultRecord *pRecord)
+{
+    if ((g_pfnFaultPolicy == 0) || !g_pfnFaultPolicy(pRecord))
+    {
+        return false;
+    }
+
+    // It is not possible to continue if the stack frame itself could
+    // not be pushed or popped, or if the PC can't be trusted.
+    if (pRecord->cfsr & (NVIC_CFSR_MLSPERR | NVIC_CFSR_MSTKERR
+                       | NVIC_CFSR_MUNSTKERR | NVIC_CFSR_LSPERR
+                       | NVIC_CFSR_STKERR | NVIC_CFSR_UNSTKERR
+                       | NVIC_CFSR_IACCVIOL | NVIC_CFSR_IBUSERR
+                       | NVIC_CFSR_INVPC | NVIC_CFSR_INVSTATE))
+    {
+        return false;
+    }
+
+    // An imprecise bus fault is reported some time after the access, so
+    // the stacked PC is not the instruction that caused it and nothing
+    // should be skipped.  Otherwise the faulting instruction has to have
+    // been captured to know its length.
+    if (!(pRecord->cfsr & NVIC_CFSR_IMPRECISERR))
+    {
+        if (pRecord->codeAddr == 0)
+        {
+            return false;
+        }
+        CMx_FaultSkipInstruction(pStackFrame,
+                                 pRecord->code[CMX_CODE_HALFWORDS - 2]);
+    }
+
+    // Clear the fault status bits (write 1 to clear) so they don't show
+    // up again in the next fault
+    NVIC_CFSR = pRecord->cfsr;
+    NVIC_HFSR = pRecord->hfsr;
+    return true;
+}
+
+/*
+ * Capture and print exception stack frame and fault registers.
+ *
+ * @param pStackFrame points at the memory location of the exception
+ * stack frame
+ * @param excReturn is the EXC_RETURN value that was in LR when the fault
+ * handler was entered
+ * @param pSpecial is the special registers read on entry to the fault
+ * handler, or NULL if they are not known
+ *
+ * @return true if the fault was recovered from and the handler should
+ * return, false if it should hang
+ */
+bool
+CMx_FaultDecoderEx(uint32_t *pStackFrame, uint32_t excReturn,
+                   const tCMxSpecialRegs *pSpecial)
+{
+    // The record is too big for the stack of the fault handler, which
+    // may be the stack that just overflowed, so there is one static
+    // record for each core instead.  A fault handler is not entered
+    // again until it returns, except when it faults itself and escalates
+    // to HardFault, and then the HardFault is what gets decoded.
+    static tCMxFaultRecord records[CMX_CORE_COUNT];
+    uint32_t core = CMX_CORE_ID();
+    tCMxFaultRecord *pRecord = &records[(core < CMX_CORE_COUNT) ? core : 0];
+    bool summarized = false;
+
+    CMx_FaultCapture(pRecord, pStackFrame, excReturn, pSpecial);
+
+#ifdef CMX_FAULT_LOG
+    // If this same fault keeps happening, just print a one line summary
+    // instead of the whole decode.
+    tCMxFaultLogEntry *pEntry = CMx_FaultLogAdd(pRecord);
+    if ((pEntry != 0) && (pEntry->windowCount > CMX_FAULT_STORM_THRESHOLD))
+    {
+        DbgPrintf("\n*** Fault %08X repeated %u times, %u since time %u (PC %08X CFSR %08X time %u) ***\n",
+                  pEntry->signature, pEntry->count, pEntry->windowCount,
+                  pEntry->windowStart, pRecord->frame[6], pRecord->cfsr,
+                  pRecord->timestamp);
+        summarized = true;
+    }
+#endif
+
+#ifdef CMX_FAULT_SHARED_LOG
+    // Put the fault in the log shared by all cores, and show if any of
+    // the other cores faulted at about the same time.
+    int32_t slot = CMx_FaultSharedLogAdd(pRecord);
+    if (slot >= 0)
+    {
+        DbgPrintf("\n*** Core %u fault ***\n", CMX_CORE_ID());
+        CMx_FaultSharedCorrelate((uint32_t)slot, CMX_FAULT_SHARED_WINDOW);
+    }
+#endif
+
+    // Faults that have already been triaged just get a summary line
+    if (!summarized && (g_pKnownFaults != 0))
+    {
+        uint32_t signature = CMx_FaultSignature(pRecord);
+        if (CMx_FaultBloomCheck(g_pKnownFaults, signature))
+        {
+            DbgPrintf("\n*** Known fault %08X (PC %08X CFSR %08X time %u) ***\n",
+                      signature, pRecord->frame[6], pRecord->cfsr,
+                      pRecord->timestamp);
+            summarized = true;
+        }
+    }
+
+    if (!summarized)
+    {
+        CMx_FaultRecordDecode(pRecord);
+    }
+
+    return FaultResume(pStackFrame, pRecord);
+}
+
+/*
+ * Print exception stack frame and fault registers.
+ *
+ * @param pStackFrame points at the memory location of the exception
+ * stack frame
+ */
+void
+CMx_FaultDecoder(uint32_t *pStackFrame)
+{
+    CMx_FaultDecoderEx(pStackFrame, 0, 0);
+}
+
+#ifndef CMX_HOST_BUILD
+#if !defined(__ARM_ARCH_6M__) && !defined(__ARM_ARCH_8M_BASE__)
+/*
+ * Access to the FAULTMASK register and the data barrier, which are
+ * needed for the memory probe functions below.  ARMv6-M has no FAULTMASK
+ * so the probe functions are left out there.
+ */
+#if defined(__GNUC__) || defined(__ICCARM__)
+static inline uint32_t
+FaultmaskGet(void)
+{
+    uint32_t faultmask;
+    __asm volatile ("mrs %0, faultmask" : "=r" (faultmask));
+    return faultmask;
+}
+#define FaultmaskSet(x) __asm volatile ("msr faultmask, %0" : : "r" (x) : "memory")
+#define DataBarrier() __asm volatile ("dsb" : : : "memory")
+
+#elif defined(__CC_ARM)
+register uint32_t __regFaultMask __asm("faultmask");
+#define FaultmaskGet() (__regFaultMask)
+#define FaultmaskSet(x) (__regFaultMask = (x))
+#define DataBarrier() __dsb(0xF)
+#endif
+
+/*
+ * Read a list of addresses that may not exist, without faulting.
+ *
+ * FAULTMASK is set so that the reads run at priority -1, and CCR
+ * BFHFNMIGN is set so that a bus fault from a load at that priority is
+ * ignored instead of locking up.  The bus fault still sets the BFSR bits,
+ * which is how a failed read is detected.  The masks are only set up once
+ * for the whole list so that probing many addresses is fast.  All
+ * interrupts are held off while this runs.
+ *
+ * This needs ARMv7-M (Cortex-M3 and up), ARMv6-M does not have FAULTMASK
+ * or BFHFNMIGN.  Only bus faults are ignored, so the addresses must be
+ * aligned.
+ *
+ * @param pAddr is the list of addresses to read
+ * @param pValue is where the value read from each address is stored, the
+ * value is 0 for an address that faulted
+ * @param pOk is set true for each address that could be read
+ * @param count is the number of addresses
+ *
+ * @return the number of addresses that could be read
+ */
+uint32_t
+CMx_ProbeRead32Multi(const uint32_t *pAddr, uint32_t *pValue, bool *pOk,
+                     uint32_t count)
+{
+    uint32_t found = 0;
+    uint32_t faultmask = FaultmaskGet();
+    uint32_t ccr = NVIC_CCR;
+
+    FaultmaskSet(1);
+    NVIC_CCR = ccr | NVIC_CCR_BFHFNMIGN;
+    DataBarrier();
+
+    // Clear any old bus fault bits so only the probe is seen
+    NVIC_CFSR = NVIC_CFSR_BFARVALID | NVIC_CFSR_PRECISERR | NVIC_CFSR_IMPRECISERR;
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t value = *((volatile uint32_t *)(uintptr_t)pAddr[i]);
+        DataBarrier();
+
+        uint32_t cfsr = NVIC_ReadCFSR();
+        if (cfsr & (NVIC_CFSR_PRECISERR | NVIC_CFSR_IMPRECISERR))
+        {
+            NVIC_CFSR = NVIC_CFSR_BFARVALID | NVIC_CFSR_PRECISERR
+                      | NVIC_CFSR_IMPRECISERR;
+            pValue[i] = 0;
+            pOk[i] = false;
+        }
+        else
+        {
+            pValue[i] = value;
+            pOk[i] = true;
+            found++;
+        }
+    }
+
+    NVIC_CCR = ccr;
+    DataBarrier();
+    FaultmaskSet(faultmask);
+    return found;
+}
+
+/*
+ * Read an address that may not exist, without faulting.  See
+ * CMx_ProbeRead32Multi().
+ *
+ * @param addr is the address to read
+ * @param pValue is where the value that was read is stored
+ *
+ * @return true if the address could be read
+ */
+bool
+CMx_ProbeRead32(uint32_t addr, uint32_t *pValue)
+{
+    bool ok;
+
+    CMx_ProbeRead32Multi(&addr, pValue, &ok, 1);
+    return ok;
+}
+#endif
+
+/*
+ * Fault handler body.  This is the same for all of the fault handlers
+ * below.
+ *
+ * NOTE: I only tested the GCC version below.  I welcome corrections.
+ *
+ * The stack pointer needs to be preserved as soon as the fault handler
+ * is entered.  Depending on bit 2 of EXC_RETURN (in LR on entry), the
+ * exception stack frame was pushed on either the main (MSP) or process
+ * (PSP) stack.  Then the decoder function can be called, passing the
+ * frame pointer and the EXC_RETURN value so that the decoder function
+ * can read register values off the stack.  The branches are used
+ * instead of an IT block so this also works on ARMv6-M.
+ *
+ * The special registers (CONTROL, the mask registers, MSP and PSP) are
+ * read next and pushed on the stack in the layout of tCMxSpecialRegs, and
+ * a pointer to them is passed as the third argument.  These are read here
+ * before anything can change them.  ARMv6-M does not have BASEPRI or
+ * FAULTMASK so zeroes are stored for those.
+ *
+ * EXC_RETURN is saved across the call.  If the decoder returns true
+ * (the recovery policy decided to continue) the handler does an
+ * exception return with it, otherwise it hangs.  For GCC and IAR the
+ * handlers are naked so the compiler can't push anything on the stack
+ * before this code runs.
+ */
+#if defined(__GNUC__) || defined(__ICCARM__)
+// The IAR version is my best guess.
+#if defined(__GNUC__)
+#define FAULT_HANDLER __attribute__((naked)) void
+#else
+#define FAULT_HANDLER __stackless void
+#endif
+#if defined(__ARM_ARCH_6M__) || defined(__ARM_ARCH_8M_BASE__)
+#define FAULT_ENTRY_MASKS                                               \
+          "    movs    r2, #0\n"                                        \
+          "    movs    r3, #0\n"
+#else
+#define FAULT_ENTRY_MASKS                                               \
+          "    mrs     r2, basepri\n"                                   \
+          "    mrs     r3, faultmask\n"
+#endif
+#define FAULT_ENTRY()                                                   \
+    __asm("    movs    r0, #4\n"                                        \
+          "    mov     r1, lr\n"                                        \
+          "    tst     r0, r1\n"                                        \
+          "    beq     1f\n"                                            \
+          "    mrs     r0, psp\n"                                       \
+          "    b       2f\n"                                            \
+          "1:  mrs     r0, msp\n"                                       \
+          "2:  mrs     r2, psp\n"                                       \
+          "    mrs     r3, msp\n"                                       \
+          "    push    {r2, r3}\n"                                      \
+          FAULT_ENTRY_MASKS                                             \
+          "    push    {r2, r3}\n"                                      \
+          "    mrs     r2, control\n"                                   \
+          "    mrs     r3, primask\n"                                   \
+          "    push    {r2, r3}\n"                                      \
+          "    mov     r2, sp\n"                                        \
+          "    push    {r1, lr}\n"                                      \
+          "    bl      CMx_FaultDecoderEx\n"                            \
+          "    pop     {r1, r2}\n"                                      \
+          "    add     sp, #24\n"                                       \
+          "    cmp     r0, #0\n"                                        \
+          "    beq     3f\n"                                            \
+          "    bx      r1\n"                                            \
+          "3:  b       3b\n")
+
+#elif defined(__CC_ARM)
+// With the Keil/ARM compiler I think you can access SP directly
+// without needing inline asm.  However you need to look at the
+// generated disassembly and make sure it is not pushing any other
+// stuff on the stack.  This version does not know EXC_RETURN or the
+// special registers so it assumes the frame is on the main stack.
+// Returning from the C function is the exception return.
+#define FAULT_HANDLER void
+#define FAULT_ENTRY()                                                   \
+    if (!CMx_FaultDecoderEx((uint32_t *)__current_sp(), 0, 0))          \
+    {                                                                   \
+        while(1)                                                        \
+        {                                                               \
+        }                                                               \
+    }
+
+#else
+#error Unrecognized toolchain in CMx_FaultHandler()
+#endif
+
+/*
+ * Hard fault handler that preserves exception stack frame.  This can
+ * also be used for the MemManage, BusFault and UsageFault vectors.
+ */
+FAULT_HANDLER
+CMx_FaultHandler(void)
+{
+    FAULT_ENTRY();
+}
+
+/*
+ * MemManage fault handler.  Only used if enabled with
+ * CMx_FaultHandlersEnable().
+ */
+FAULT_HANDLER
+CMx_MemManageHandler(void)
+{
+    FAULT_ENTRY();
+}
+
+/*
+ * BusFault handler.  Only used if enabled with CMx_FaultHandlersEnable().
+ */
+FAULT_HANDLER
+CMx_BusFaultHandler(void)
+{
+    FAULT_ENTRY();
+}
+
+/*
+ * UsageFault handler.  Only used if enabled with
+ * CMx_FaultHandlersEnable().
+ */
+FAULT_HANDLER
+CMx_UsageFaultHandler(void)
+{
+    FAULT_ENTRY();
+}
+#endif
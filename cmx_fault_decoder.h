@@ -34,6 +34,9 @@
 #ifndef __CMX_FAULT_DECODER_H__
 #define __CMX_FAULT_DECODER_H__
 
+#include <stdint.h>
+#include <stdbool.h>
+
 /*
  * This module provides a text based fault decoder for ARM Cortex-M
  * microcontrollers.  See the matching .c file for more information.
@@ -43,8 +46,526 @@
 extern "C" {
 #endif
 
+/*
+ * Number of instruction halfwords captured around the faulting PC.  The
+ * last two are at the PC, the rest are the instructions leading up to it.
+ */
+#ifndef CMX_CODE_HALFWORDS
+#define CMX_CODE_HALFWORDS 8
+#endif
+
+/*
+ * Number of code halfwords, ending just after the PC, that identify a
+ * fault when CMX_STABLE_SIGNATURE is defined.  At most 8.
+ */
+#ifndef CMX_STABLE_SIGNATURE_HALFWORDS
+#define CMX_STABLE_SIGNATURE_HALFWORDS 8
+#endif
+
+/*
+ * Exception numbers of the fault handlers, as saved in the fault record.
+ */
+#define CMX_EXC_HARDFAULT       3
+#define CMX_EXC_MEMMANAGE       4
+#define CMX_EXC_BUSFAULT        5
+#define CMX_EXC_USAGEFAULT      6
+
+/*
+ * Fault handlers that can be enabled with CMx_FaultHandlersEnable().
+ * These are the enable bits in SHCSR.
+ */
+#define CMX_FAULT_MEMMANAGE     0x00010000
+#define CMX_FAULT_BUS           0x00020000
+#define CMX_FAULT_USAGE         0x00040000
+
+/*
+ * Fault classes and severities assigned by CMx_FaultClassify().
+ */
+#define CMX_CLASS_UNKNOWN       0
+#define CMX_CLASS_VECTOR        1
+#define CMX_CLASS_STACK         2
+#define CMX_CLASS_CODE          3
+#define CMX_CLASS_MEMORY        4
+#define CMX_CLASS_NULLPTR       5
+#define CMX_CLASS_BUS           6
+#define CMX_CLASS_FPU           7
+#define CMX_CLASS_ALIGN         8
+#define CMX_CLASS_MATH          9
+#define CMX_CLASS_DEBUG         10
+
+#define CMX_SEVERITY_INFO       0
+#define CMX_SEVERITY_LOW        1
+#define CMX_SEVERITY_MEDIUM     2
+#define CMX_SEVERITY_HIGH       3
+#define CMX_SEVERITY_CRITICAL   4
+
+/*
+ * Fault addresses below this are treated as null pointer accesses.
+ */
+#ifndef CMX_NULL_LIMIT
+#define CMX_NULL_LIMIT 0x400
+#endif
+
+/*
+ * Number of MPU regions saved in the fault record.
+ */
+#ifndef CMX_MPU_REGIONS
+#define CMX_MPU_REGIONS 8
+#endif
+
+/*
+ * Number of 32-bit words of NVIC pending and active bits saved in the
+ * fault record.  Each word covers 32 interrupts.
+ */
+#ifndef CMX_NVIC_WORDS
+#define CMX_NVIC_WORDS 2
+#endif
+
+/*
+ * Number of cores that run this code.  The fault handler keeps one fault
+ * record for each core, selected with CMX_CORE_ID().
+ */
+#ifndef CMX_CORE_COUNT
+#define CMX_CORE_COUNT 1
+#endif
+
+/*
+ * Stack overflow checking.  CMX_MAX_STACKS is how many stacks are checked
+ * at fault time (at most 32), CMX_STACK_PAINT is the pattern that unused
+ * stack is filled with, and CMX_STACK_GUARD_WORDS is how many words at the
+ * bottom of each stack must still hold the pattern.
+ */
+#ifndef CMX_MAX_STACKS
+#define CMX_MAX_STACKS 8
+#endif
+#ifndef CMX_STACK_PAINT
+#define CMX_STACK_PAINT 0xA5A5A5A5
+#endif
+#ifndef CMX_STACK_GUARD_WORDS
+#define CMX_STACK_GUARD_WORDS 4
+#endif
+
+/*
+ * A stack to check for overflow.
+ */
+typedef struct
+{
+    uint32_t base;          // lowest address of the stack
+    uint32_t size;          // size of the stack in bytes
+} tCMxStack;
+
+/*
+ * Limits on the heap check in the fault handler, in CPU cycles and in
+ * number of heap blocks.
+ */
+#ifndef CMX_HEAP_BUDGET_CYCLES
+#define CMX_HEAP_BUDGET_CYCLES 50000
+#endif
+#ifndef CMX_HEAP_MAX_BLOCKS
+#define CMX_HEAP_MAX_BLOCKS 1000
+#endif
+
+/*
+ * Result of the heap check, as saved in the fault record.
+ */
+#define CMX_HEAP_NOT_CHECKED    0
+#define CMX_HEAP_OK             1
+#define CMX_HEAP_CORRUPT        2
+#define CMX_HEAP_BUDGET         3
+
+/*
+ * Heap adapter.  This describes the heap to the fault handler so that it
+ * can be walked.  The heap is a list of adjacent blocks from start to
+ * end.  pfnBlock is called for each block and must check the block header
+ * and return false if it is not valid.  Otherwise it returns the address
+ * of the next block, the size of this block, and whether it is free.  It
+ * is called from the fault handler so it must not allocate or lock.
+ */
+typedef struct
+{
+    uint32_t start;         // address of the first block
+    uint32_t end;           // address just past the last block
+    bool (*pfnBlock)(uint32_t block, uint32_t *pNext, uint32_t *pSize,
+                     bool *pFree);
+} tCMxHeapAdapter;
+
+/*
+ * Special registers read on entry to the fault handler.  The order of
+ * these matches the order the fault handler pushes them.
+ */
+typedef struct
+{
+    uint32_t control;       // CONTROL register
+    uint32_t primask;       // PRIMASK register
+    uint32_t basepri;       // BASEPRI register, 0 on ARMv6-M
+    uint32_t faultmask;     // FAULTMASK register, 0 on ARMv6-M
+    uint32_t psp;           // process stack pointer
+    uint32_t msp;           // main stack pointer on entry to the handler
+} tCMxSpecialRegs;
+
+/*
+ * Fault information captured at the time of the fault.  It can be
+ * printed right away or kept and decoded later.
+ */
+typedef struct
+{
+    uint32_t timestamp;     // time of the fault from the time source
+    uint32_t buildId;       // firmware build from CMX_BUILD_ID
+    uint32_t faultClass;    // fault class, CMX_CLASS_xxx
+    uint32_t severity;      // fault severity, CMX_SEVERITY_xxx
+    uint32_t frame[8];      // R0, R1, R2, R3, R12, LR, PC, xPSR
+    uint32_t excReturn;     // EXC_RETURN from LR on entry, 0 if unknown
+    uint32_t sp;            // stack pointer before the frame was pushed
+    uint32_t exception;     // active exception number when captured
+    tCMxSpecialRegs special; // special registers, 0 if not known
+    uint32_t nvicPending[CMX_NVIC_WORDS]; // NVIC interrupt pending bits
+    uint32_t nvicActive[CMX_NVIC_WORDS]; // NVIC interrupt active bits
+    uint32_t numStacks;     // number of stacks checked
+    uint32_t stackOverflow; // bit set for each stack with bad guard words
+    uint32_t stackHeadroom[CMX_MAX_STACKS]; // unused bytes on each stack
+    uint32_t heapStatus;    // result of the heap check, CMX_HEAP_xxx
+    uint32_t heapBadBlock;  // block where the heap check stopped
+    uint32_t heapBlocks;    // number of good heap blocks
+    uint32_t heapUsed;      // bytes in used heap blocks
+    uint32_t heapFree;      // bytes in free heap blocks
+    uint32_t heapLargestFree; // size of the largest free heap block
+    uint32_t cfsr;          // configurable fault status register
+    uint32_t hfsr;          // hard fault status register
+    uint32_t mmfar;         // memory management fault address register
+    uint32_t bfar;          // bus fault address register
+    uint32_t codeAddr;      // address of code[0], 0 if code not captured
+    uint16_t code[CMX_CODE_HALFWORDS]; // instructions up to and at the PC
+    uint32_t mpuType;       // MPU type register, 0 if no MPU
+    uint32_t mpuCtrl;       // MPU control register
+    uint32_t mpuRbar[CMX_MPU_REGIONS]; // region base address registers
+    uint32_t mpuRasr[CMX_MPU_REGIONS]; // region attribute and size registers
+} tCMxFaultRecord;
+
+/*
+ * Packed fault record, for sending records off the device.  The record
+ * starts with a 3 word header: CMX_RECORD_MAGIC, the schema version in
+ * the upper 16 bits and the size in bytes in the lower 16 bits, and a
+ * bitmap of the fields that are present.  Each field has a fixed word
+ * offset that never changes.  New fields are only ever added at the end
+ * with a new version, so a field is missing if its presence bit is clear
+ * or the record is too short to hold it.
+ *
+ * The fields are listed as X(ID, name, word offset, number of words).
+ * Code halfwords are packed two to a word, the lower address in the low
+ * half.  Version 2 added BUILD_ID, and version 3 added LOG (the fault
+ * log sequence number and count, only in records from the fault log).
+ */
+#define CMX_RECORD_MAGIC 0x52584D43 // "CMXR"
+#define CMX_RECORD_VERSION 3
+#define CMX_RECORD_FIELDS(X)                                            \
+    X(TIMESTAMP,    timestamp,      3,  1)                              \
+    X(CLASS,        faultClass,     4,  1)                              \
+    X(SEVERITY,     severity,       5,  1)                              \
+    X(FRAME,        frame,          6,  8)                              \
+    X(EXC_RETURN,   excReturn,     14,  1)                              \
+    X(SP,           sp,            15,  1)                              \
+    X(EXCEPTION,    exception,     16,  1)                              \
+    X(CFSR,         cfsr,          17,  1)                              \
+    X(HFSR,         hfsr,          18,  1)                              \
+    X(MMFAR,        mmfar,         19,  1)                              \
+    X(BFAR,         bfar,          20,  1)                              \
+    X(CODE_ADDR,    codeAddr,      21,  1)                              \
+    X(CODE,         code,          22,  4)                              \
+    X(MPU_TYPE,     mpuType,       26,  1)                              \
+    X(MPU_CTRL,     mpuCtrl,       27,  1)                              \
+    X(MPU_RBAR,     mpuRbar,       28, 16)                              \
+    X(MPU_RASR,     mpuRasr,       44, 16)                              \
+    X(SPECIAL,      special,       60,  6)                              \
+    X(NVIC_PENDING, nvicPending,   66,  8)                              \
+    X(NVIC_ACTIVE,  nvicActive,    74,  8)                              \
+    X(NUM_STACKS,   numStacks,     82,  1)                              \
+    X(STACK_OVERFLOW, stackOverflow, 83, 1)                             \
+    X(STACK_HEADROOM, stackHeadroom, 84, 8)                             \
+    X(HEAP,         heap,          92,  6)                              \
+    X(BUILD_ID,     buildId,       98,  1)                              \
+    X(LOG,          log,           99,  2)
+#define CMX_RECORD_HEADER_WORDS 3
+#define CMX_RECORD_WORDS 101
+#define CMX_RECORD_COMPRESSED_MAX ((CMX_RECORD_WORDS * 6) + 5)
+
+#define CMX_RECORD_FIELD_ID(id, name, offset, words) CMX_FIELD_##id,
+enum
+{
+    CMX_RECORD_FIELDS(CMX_RECORD_FIELD_ID)
+    CMX_FIELD_COUNT
+};
+
+/*
+ * Read one word of a field directly from a packed record, for example in
+ * a buffer or a memory mapped file on the host.  The record must be word
+ * aligned and both sides little endian.  Returns 0 if the field or that
+ * word of it is not in the record.
+ */
+static inline uint32_t
+CMx_RecordGet(const void *pRecord, uint32_t field, uint32_t offset,
+              uint32_t words, uint32_t index)
+{
+    const uint32_t *pWords = (const uint32_t *)pRecord;
+
+    if ((index >= words) || !(pWords[2] & (1UL << field))
+     || (((offset + index) * 4) >= (pWords[1] & 0xFFFF)))
+    {
+        return 0;
+    }
+    return pWords[offset + index];
+}
+
+/*
+ * Accessors for each field of a packed record, CMx_Record_cfsr(p, 0) and
+ * so on.  For a field with more than one word, index selects the word.
+ */
+#define CMX_RECORD_FIELD_GET(id, name, offset, words)                   \
+    static inline uint32_t                                              \
+    CMx_Record_##name(const void *pRecord, uint32_t index)              \
+    {                                                                   \
+        return CMx_RecordGet(pRecord, CMX_FIELD_##id, offset, words,    \
+                             index);                                    \
+    }
+CMX_RECORD_FIELDS(CMX_RECORD_FIELD_GET)
+
+/*
+ * Functions exported from a host shared library build (CMX_SHARED_LIB).
+ * They only take integers and arrays, so CMX_API_VERSION only changes if
+ * one of them does.  Version 2 has CMx_FaultBatchSignature() return the
+ * number of signatures, and keeps it in CMX_STABLE_SIGNATURE builds.
+ */
+#define CMX_API_VERSION 2
+#if defined(CMX_SHARED_LIB) && defined(_WIN32)
+#define CMX_API __declspec(dllexport)
+#elif defined(CMX_SHARED_LIB) && defined(__GNUC__)
+#define CMX_API __attribute__((visibility("default")))
+#else
+#define CMX_API
+#endif
+
+/*
+ * Bloom filter of fault signatures.  The bit array must be numBits / 32
+ * words long and numBits must be a power of 2, 32 or more.
+ */
+typedef struct
+{
+    uint32_t *pBits;        // the filter bit array
+    uint32_t numBits;       // number of bits in the filter (m)
+    uint32_t numHashes;     // number of bits set per signature (k)
+} tCMxFaultBloom;
+
+/*
+ * Decoder context.  The output function is called like printf with pArg
+ * added as the first argument.
+ */
+typedef struct
+{
+    int (*pfnPrintf)(void *pArg, const char *format, ...); // NULL for DbgPrintf
+    void *pArg;             // passed to pfnPrintf
+} tCMxDecodeCtx;
+
+/*
+ * Time source for fault records.  Returns the current time in units
+ * chosen by the application.
+ */
+typedef uint32_t (*tCMxTimeSource)(void);
+
+/*
+ * Recovery policy.  Return true to resume after the faulting instruction
+ * instead of hanging.
+ */
+typedef bool (*tCMxFaultPolicy)(const tCMxFaultRecord *pRecord);
+
+/*
+ * Size of the retained fault log, and how many times the same fault may
+ * occur within CMX_FAULT_STORM_WINDOW (in the units of the time source)
+ * before only a summary is printed.
+ */
+#ifndef CMX_FAULT_LOG_ENTRIES
+#define CMX_FAULT_LOG_ENTRIES 4
+#endif
+#ifndef CMX_FAULT_STORM_THRESHOLD
+#define CMX_FAULT_STORM_THRESHOLD 3
+#endif
+#ifndef CMX_FAULT_STORM_WINDOW
+#define CMX_FAULT_STORM_WINDOW 60
+#endif
+#ifndef CMX_FAULT_HISTORY_BYTES
+#define CMX_FAULT_HISTORY_BYTES 96
+#endif
+
+/*
+ * One entry of the retained fault log.  The record is from the first
+ * time the fault occurred.
+ */
+typedef struct
+{
+    uint32_t signature;     // signature from CMx_FaultSignature()
+    uint32_t count;         // times this fault occurred, 0 if entry unused
+    uint32_t seq;           // order the entry was added in
+    uint32_t windowStart;   // time the current storm window started
+    uint32_t windowCount;   // times this fault occurred in the window
+    bool sent;              // entry has been sent off the device
+    tCMxFaultRecord record; // first occurrence of the fault
+} tCMxFaultLogEntry;
+
+/*
+ * Size of the fault log shared between cores, and the time window for
+ * treating faults on different cores as related.
+ */
+#ifndef CMX_FAULT_SHARED_ENTRIES
+#define CMX_FAULT_SHARED_ENTRIES 4
+#endif
+#ifndef CMX_FAULT_SHARED_WINDOW
+#define CMX_FAULT_SHARED_WINDOW 10
+#endif
+
+/*
+ * One entry of the shared fault log.
+ */
+typedef struct
+{
+    uint32_t seq;           // sequence number + 1, 0 if not valid
+    uint32_t coreId;        // core that had the fault
+    uint32_t boot;          // boot count of the log when it was added
+    tCMxFaultRecord record; // the fault
+} tCMxFaultSharedEntry;
+
+/*
+ * Fault log shared between cores.  Slots are claimed in the order of the
+ * next sequence number, as a ring.
+ */
+typedef struct
+{
+    uint32_t magic;         // marks the log as initialized
+    uint32_t layout;        // layout version and size of the log
+    uint32_t config;        // configuration that changes the record
+    uint32_t next;          // next sequence number to claim
+    uint32_t boot;          // times the log was initialized at startup
+    tCMxFaultSharedEntry entries[CMX_FAULT_SHARED_ENTRIES];
+} tCMxFaultSharedLog;
+
+/*
+ * One event from the fault history.
+ */
+typedef struct
+{
+    uint32_t time;          // timestamp of the fault record
+    uint32_t buildId;       // firmware build from CMX_BUILD_ID
+    uint32_t signature;     // signature from CMx_FaultSignature()
+} tCMxFaultEvent;
+
+/*
+ * Retained fault log.  Once it is full the least severe entry is
+ * replaced.  It also has a compact history of all faults.
+ */
+typedef struct
+{
+    uint32_t magic;         // marks the log as initialized
+    uint32_t layout;        // layout version and size of the log
+    uint32_t config;        // configuration that changes the record
+    uint32_t total;         // total number of faults logged
+    tCMxFaultLogEntry entries[CMX_FAULT_LOG_ENTRIES];
+    uint32_t histBaseTime;  // time before the first history event
+    uint32_t histBaseBuild; // build ID before the first history event
+    uint32_t histLastTime;  // time of the last history event
+    uint32_t histLastBuild; // build ID of the last history event
+    uint32_t histLen;       // number of bytes used in history
+    uint8_t history[CMX_FAULT_HISTORY_BYTES]; // delta encoded events
+} tCMxFaultLog;
+
+extern void CMx_FaultSetStacks(const tCMxStack *pStacks, uint32_t count);
+extern void CMx_StackPaint(uint32_t base, uint32_t size);
+extern uint32_t CMx_StackHeadroom(uint32_t base, uint32_t size);
+extern void CMx_FaultSetHeapAdapter(const tCMxHeapAdapter *pAdapter);
+extern void CMx_FaultSetTimeSource(tCMxTimeSource pfnTime);
+extern void CMx_FaultCapture(tCMxFaultRecord *pRecord, uint32_t *pStackFrame,
+                             uint32_t excReturn,
+                             const tCMxSpecialRegs *pSpecial);
+extern void CMx_FaultClassify(tCMxFaultRecord *pRecord);
+extern int32_t CMx_FaultMpuMatch(const tCMxFaultRecord *pRecord, uint32_t addr);
+extern void CMx_FaultRecordDecodeCtx(const tCMxDecodeCtx *pCtx,
+                                     const tCMxFaultRecord *pRecord);
+extern void CMx_FaultRecordDecode(const tCMxFaultRecord *pRecord);
+extern void CMx_FaultHandlersEnable(uint32_t faults);
+extern uint32_t CMx_FaultSignature(const tCMxFaultRecord *pRecord);
+extern uint32_t CMx_FaultRecordPack(const tCMxFaultRecord *pRecord,
+                                    uint32_t *pBuf);
+extern bool CMx_FaultRecordUnpack(const uint32_t *pBuf,
+                                  tCMxFaultRecord *pRecord);
+extern CMX_API uint32_t CMx_ApiVersion(void);
+extern CMX_API uint32_t CMx_FaultBatchDecode(const uint32_t *pRecords,
+                                             uint32_t words, uint32_t maxCount,
+                                             uint32_t *pSignature,
+                                             uint32_t *pClass,
+                                             uint32_t *pSeverity);
+extern CMX_API uint32_t CMx_FaultBatchColumn(const uint32_t *pRecords,
+                                             uint32_t words, uint32_t maxCount,
+                                             uint32_t field, uint32_t index,
+                                             uint32_t *pColumn);
+extern CMX_API uint32_t CMx_FaultBatchSelect(const uint32_t *pRecords,
+                                             uint32_t words, uint32_t maxCount,
+                                             uint32_t buildId,
+                                             uint32_t timeStart,
+                                             uint32_t timeEnd,
+                                             uint32_t *pOffsets);
+extern CMX_API uint32_t CMx_FaultBatchSignature(const uint32_t *pPc,
+                                                const uint32_t *pLr,
+                                                const uint32_t *pCfsr,
+                                                const uint32_t *pHfsr,
+                                                uint32_t count,
+                                                uint32_t *pSignature);
+extern CMX_API uint32_t CMx_SignatureRollup(uint32_t *pSignature,
+                                            uint32_t count, uint32_t *pCount);
+extern CMX_API uint32_t CMx_SignatureMerge(const uint32_t *pSigA,
+                                           const uint32_t *pCountA,
+                                           uint32_t numA,
+                                           const uint32_t *pSigB,
+                                           const uint32_t *pCountB,
+                                           uint32_t numB, uint32_t *pSigOut,
+                                           uint32_t *pCountOut);
+extern CMX_API uint32_t CMx_RecordDictTrain(const uint32_t *pRecords,
+                                            uint32_t words, uint32_t *pDict);
+extern CMX_API uint32_t CMx_RecordCompress(const uint32_t *pRecord,
+                                           const uint32_t *pDict,
+                                           uint8_t *pOut, uint32_t outSize);
+extern CMX_API uint32_t CMx_RecordDecompress(const uint8_t *pIn,
+                                             uint32_t inSize,
+                                             const uint32_t *pDict,
+                                             uint32_t *pRecord,
+                                             uint32_t maxWords);
+extern void CMx_FaultBloomAdd(tCMxFaultBloom *pBloom, uint32_t signature);
+extern bool CMx_FaultBloomCheck(const tCMxFaultBloom *pBloom,
+                                uint32_t signature);
+extern bool CMx_FaultSetKnown(const tCMxFaultBloom *pBloom);
+extern tCMxFaultLog *CMx_FaultLogGet(void);
+extern void CMx_FaultLogClear(void);
+extern tCMxFaultLogEntry *CMx_FaultLogAdd(const tCMxFaultRecord *pRecord);
+extern tCMxFaultLogEntry *CMx_FaultLogNextToSend(void);
+extern void CMx_FaultLogMarkSent(tCMxFaultLogEntry *pEntry);
+extern uint32_t CMx_FaultLogEntryPack(const tCMxFaultLogEntry *pEntry,
+                                      uint32_t *pBuf);
+extern bool CMx_FaultHistoryRead(const tCMxFaultLog *pLog, uint32_t *pOffset,
+                                 tCMxFaultEvent *pEvent);
+extern void CMx_FaultSharedLogInit(bool clear);
+extern const volatile tCMxFaultSharedLog *CMx_FaultSharedLogGet(void);
+extern int32_t CMx_FaultSharedLogAdd(const tCMxFaultRecord *pRecord);
+extern uint32_t CMx_FaultSharedCorrelate(uint32_t slot, uint32_t window);
+extern uint32_t CMx_ThumbInstrLen(uint16_t opcode);
+extern uint32_t CMx_FaultSkipInstruction(uint32_t *pStackFrame, uint16_t opcode);
+extern void CMx_FaultSetPolicy(tCMxFaultPolicy pfnPolicy);
+extern bool CMx_FaultDecoderEx(uint32_t *pStackFrame, uint32_t excReturn,
+                               const tCMxSpecialRegs *pSpecial);
 extern void CMx_FaultDecoder(uint32_t *pStackFrame);
+#if !defined(__ARM_ARCH_6M__) && !defined(__ARM_ARCH_8M_BASE__)
+extern uint32_t CMx_ProbeRead32Multi(const uint32_t *pAddr, uint32_t *pValue,
+                                     bool *pOk, uint32_t count);
+extern bool CMx_ProbeRead32(uint32_t addr, uint32_t *pValue);
+#endif
 extern void CMx_FaultHandler(void);
+extern void CMx_MemManageHandler(void);
+extern void CMx_BusFaultHandler(void);
+extern void CMx_UsageFaultHandler(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,409 @@
+/******************************************************************************
+ *
+ * host_harness.c - Host tests of fault capture with synthetic exception
+ * frames, EXC_RETURN values and a simulated memory map
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdarg.h>
+#include <time.h>
+
+#include "host_sim.h"
+#include "cmx_fault_decoder.c"
+
+/* Stack frame, with room for the FPU state and a padding word after it */
+static uint32_t g_stack[0x68 / 4 + 1];
+
+/* Output of a decoder context */
+static char g_output[4096];
+static size_t g_outputLen;
+
+static int
+OutputPrintf(void *pArg, const char *format, ...)
+{
+    va_list args;
+    (void)pArg;
+
+    va_start(args, format);
+    int n = vsnprintf(&g_output[g_outputLen], sizeof(g_output) - g_outputLen,
+                      format, args);
+    va_end(args);
+    if (n > 0)
+    {
+        g_outputLen += n;
+        if (g_outputLen >= sizeof(g_output))
+        {
+            g_outputLen = sizeof(g_output) - 1;
+        }
+    }
+    return n;
+}
+
+/* Set up a fault frame with the PC at the given address */
+static void
+SetupFrame(uint32_t pc, uint32_t xpsr)
+{
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        g_stack[i] = 0x100 + i;
+    }
+    g_stack[6] = pc;
+    g_stack[7] = xpsr;
+}
+
+static void
+TestStackPointer(void)
+{
+    tCMxFaultRecord record;
+    uint32_t frame = (uint32_t)(uintptr_t)g_stack;
+
+    SimReset();
+    SetupFrame(SIM_CODE_BASE + 0x40, 0x01000000);
+
+    // Basic frame on the main stack, from handler mode
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF1, 0);
+    CHECK(record.sp == frame + 0x20);
+    CHECK(record.excReturn == 0xFFFFFFF1);
+
+    // Basic frame on the process stack, from thread mode
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFFD, 0);
+    CHECK(record.sp == frame + 0x20);
+
+    // Frame with FPU state
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFED, 0);
+    CHECK(record.sp == frame + 0x68);
+
+    // EXC_RETURN not known, a basic frame is assumed
+    CMx_FaultCapture(&record, g_stack, 0, 0);
+    CHECK(record.sp == frame + 0x20);
+
+    // Padding word from stack alignment
+    g_stack[7] |= 0x200;
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    CHECK(record.sp == frame + 0x24);
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFE9, 0);
+    CHECK(record.sp == frame + 0x6C);
+}
+
+static void
+TestRegisters(void)
+{
+    tCMxFaultRecord record;
+    tCMxSpecialRegs special = { 2, 1, 0x20, 0, 0x20001000, 0x20002000 };
+
+    SimReset();
+    SetupFrame(SIM_CODE_BASE + 0x40, 0x01000000);
+    SIM_SCS(0xE000ED04) = 0x00000803;   // ICSR, hard fault active
+    SIM_SCS(0xE000ED28) = 0x00008200;   // CFSR, BFARVALID | PRECISERR
+    SIM_SCS(0xE000ED2C) = 0x40000000;   // HFSR, FORCED
+    SIM_SCS(0xE000ED34) = 0x11111111;
+    SIM_SCS(0xE000ED38) = 0x40001234;
+    SIM_SCS(0xE000E200) = 0x00000010;   // IRQ 4 pending
+    SIM_SCS(0xE000E304) = 0x00000001;   // IRQ 32 active
+
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, &special);
+    for (uint32_t i = 0; i < 6; i++)
+    {
+        CHECK(record.frame[i] == 0x100 + i);
+    }
+    CHECK(record.frame[6] == SIM_CODE_BASE + 0x40);
+    CHECK(record.exception == CMX_EXC_HARDFAULT);
+    CHECK(record.cfsr == 0x00008200);
+    CHECK(record.hfsr == 0x40000000);
+    CHECK(record.mmfar == 0x11111111);
+    CHECK(record.bfar == 0x40001234);
+    CHECK(record.nvicPending[0] == 0x10);
+    CHECK(record.nvicActive[1] == 0x01);
+    CHECK(record.special.basepri == 0x20);
+    CHECK(record.special.msp == 0x20002000);
+    CHECK(record.faultClass == CMX_CLASS_BUS);
+    CHECK(g_simBadReads == 0);
+}
+
+static void
+TestCodeCapture(void)
+{
+    tCMxFaultRecord record;
+    uint32_t pc = SIM_CODE_BASE + 0x40;
+
+    SimReset();
+    for (uint32_t i = 0; i < SIM_CODE_HALFWORDS; i++)
+    {
+        g_simCode[i] = 0x4600 + i;
+    }
+
+#ifdef SIM_NO_CODE_RANGE
+    // Without a code range nothing is read or packed
+    uint32_t packed[CMX_RECORD_WORDS];
+    SetupFrame(pc | 1, 0x01000000);
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    CHECK(record.codeAddr == 0);
+    CHECK(record.code[CMX_CODE_HALFWORDS - 2] == 0);
+    CMx_FaultRecordPack(&record, packed);
+    CHECK(!(packed[2] & (1UL << CMX_FIELD_CODE_ADDR)));
+    CHECK(!(packed[2] & (1UL << CMX_FIELD_CODE)));
+#else
+
+    // The code leading up to the PC and the halfword after it
+    SetupFrame(pc | 1, 0x01000000);
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    CHECK(record.codeAddr == pc - ((CMX_CODE_HALFWORDS - 2) * 2));
+    CHECK(record.code[CMX_CODE_HALFWORDS - 2] == 0x4600 + 0x20);
+    CHECK(record.code[0] == 0x4600 + 0x20 - (CMX_CODE_HALFWORDS - 2));
+
+    // Too close to the start of the code region
+    SetupFrame(SIM_CODE_BASE + 2, 0x01000000);
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    CHECK(record.codeAddr == 0);
+
+    // PC outside of the code region
+    SetupFrame(0x20000100, 0x01000000);
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    CHECK(record.codeAddr == 0);
+
+    // Last instruction in the code region, and one past it
+    SetupFrame(CMX_CODE_END - 4, 0x01000000);
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    CHECK(record.codeAddr == CMX_CODE_END - (CMX_CODE_HALFWORDS * 2));
+    SetupFrame(CMX_CODE_END - 2, 0x01000000);
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    CHECK(record.codeAddr == 0);
+
+    // PC wraps below address 0
+    SetupFrame(0x00000002, 0x01000000);
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    CHECK(record.codeAddr == 0);
+
+    // Fault on the instruction fetch
+    SIM_SCS(0xE000ED28) = 0x00000001;   // IACCVIOL
+    SetupFrame(pc, 0x01000000);
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    CHECK(record.codeAddr == 0);
+
+    // Errors stacking or unstacking the frame, the stacked PC is not valid
+    static const uint32_t stackErrors[] =
+    {
+        0x00001000,                     // STKERR
+        0x00000800,                     // UNSTKERR
+        0x00000010,                     // MSTKERR
+        0x00000008,                     // MUNSTKERR
+    };
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        SIM_SCS(0xE000ED28) = stackErrors[i];
+        CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+        CHECK(record.codeAddr == 0);
+    }
+#endif
+
+    CHECK(g_simBadReads == 0);
+}
+
+static void
+TestMpuCapture(void)
+{
+    tCMxFaultRecord record;
+
+    SimReset();
+    SetupFrame(SIM_CODE_BASE + 0x40, 0x01000000);
+    SIM_SCS(0xE000ED90) = 4 << 8;       // MPU_TYPE, 4 regions
+    SIM_SCS(0xE000ED94) = 0x00000005;   // MPU_CTRL
+    SIM_SCS(0xE000ED98) = 2;            // MPU_RNR
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        g_simMpuRbar[i] = 0x20000000 + (i * 0x1000) + i;
+        g_simMpuRasr[i] = 0x03000017;
+    }
+
+    SIM_SCS(0xE000ED04) = CMX_EXC_MEMMANAGE;
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    CHECK(record.mpuType == (4 << 8));
+    CHECK(record.mpuCtrl == 5);
+    CHECK(record.mpuRbar[3] == 0x20003003);
+    CHECK(record.mpuRasr[0] == 0x03000017);
+    for (uint32_t i = 4; i < CMX_MPU_REGIONS; i++)
+    {
+        CHECK((record.mpuRbar[i] == 0) && (record.mpuRasr[i] == 0));
+    }
+    CHECK(SIM_SCS(0xE000ED98) == 2);    // region number put back
+
+    // Not captured in the bus fault handler
+    SIM_SCS(0xE000ED04) = CMX_EXC_BUSFAULT;
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    CHECK(record.mpuType == 0);
+    CHECK(record.mpuRbar[0] == 0);
+}
+
+static void
+TestDecode(void)
+{
+    tCMxFaultRecord record;
+    tCMxDecodeCtx ctx = { OutputPrintf, 0 };
+
+    SimReset();
+    SetupFrame(SIM_CODE_BASE + 0x40, 0x01000000);
+    SIM_SCS(0xE000ED04) = CMX_EXC_MEMMANAGE;
+    SIM_SCS(0xE000ED28) = 0x00000082;   // MMARVALID | DACCVIOL
+    SIM_SCS(0xE000ED34) = 0x00000008;
+
+    CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    g_outputLen = 0;
+    g_output[0] = 0;
+    CMx_FaultRecordDecodeCtx(&ctx, &record);
+    CHECK(strstr(g_output, "*** MemManage fault ***") != 0);
+    CHECK(strstr(g_output, "DACCVIOL") != 0);
+    CHECK(strstr(g_output, "MMFAR: 00000008") != 0);
+    CHECK(strstr(g_output, "BFSR") == 0);
+    CHECK(strstr(g_output, "null pointer") != 0);
+}
+
+/* Recovery policy for the tests, resumes if g_resume is set */
+static bool g_resume;
+static uint32_t g_policyCalls;
+
+static bool
+TestPolicy(const tCMxFaultRecord *pRecord)
+{
+    (void)pRecord;
+    g_policyCalls++;
+    return g_resume;
+}
+
+/* Set up the registers for a precise bus fault at a captured PC */
+static void
+SetupBusFault(void)
+{
+    SimReset();
+    for (uint32_t i = 0; i < SIM_CODE_HALFWORDS; i++)
+    {
+        g_simCode[i] = 0x6800;          // LDR r0, [r0]
+    }
+    SetupFrame(SIM_CODE_BASE + 0x40, 0x01000000);
+    SIM_SCS(0xE000ED04) = CMX_EXC_BUSFAULT;
+    SIM_SCS(0xE000ED28) = 0x00008200;   // BFARVALID | PRECISERR
+    SIM_SCS(0xE000ED38) = 0x40001234;
+}
+
+static void
+TestDecoderEx(void)
+{
+    // Without a policy the fault is decoded and the handler hangs
+    SetupBusFault();
+    SimOutputClear();
+    CMx_FaultSetPolicy(0);
+    CHECK(!CMx_FaultDecoderEx(g_stack, 0xFFFFFFF9, 0));
+    CHECK(strstr(g_simOutput, "*** BusFault ***") != 0);
+    CHECK(strstr(g_simOutput, "BFAR: 40001234") != 0);
+    CHECK(g_stack[6] == SIM_CODE_BASE + 0x40);
+
+    // The policy says no
+    SetupBusFault();
+    CMx_FaultSetPolicy(TestPolicy);
+    g_resume = false;
+    g_policyCalls = 0;
+    CHECK(!CMx_FaultDecoderEx(g_stack, 0xFFFFFFF9, 0));
+    CHECK(g_policyCalls == 1);
+    CHECK(g_stack[6] == SIM_CODE_BASE + 0x40);
+
+    // Can't resume after an error stacking the frame, whatever the policy
+    g_resume = true;
+    SetupBusFault();
+    SIM_SCS(0xE000ED28) = 0x00001000;   // STKERR
+    CHECK(!CMx_FaultDecoderEx(g_stack, 0xFFFFFFF9, 0));
+    CHECK(g_stack[6] == SIM_CODE_BASE + 0x40);
+
+    // An imprecise fault resumes without skipping anything
+    SetupBusFault();
+    SIM_SCS(0xE000ED28) = 0x00000400;   // IMPRECISERR
+    CHECK(CMx_FaultDecoderEx(g_stack, 0xFFFFFFF9, 0));
+    CHECK(g_stack[6] == SIM_CODE_BASE + 0x40);
+
+    // The policy says yes, so the load is skipped and CFSR cleared.  That
+    // needs the code to know the length of the instruction.
+    SetupBusFault();
+#ifdef SIM_NO_CODE_RANGE
+    CHECK(!CMx_FaultDecoderEx(g_stack, 0xFFFFFFF9, 0));
+    CHECK(g_stack[6] == SIM_CODE_BASE + 0x40);
+#else
+    CHECK(CMx_FaultDecoderEx(g_stack, 0xFFFFFFF9, 0));
+    CHECK(g_stack[6] == SIM_CODE_BASE + 0x42);
+    CHECK(SIM_SCS(0xE000ED28) == 0x00008200);
+#endif
+
+    CMx_FaultSetPolicy(0);
+}
+
+/* Nanoseconds from the monotonic clock */
+static uint64_t
+NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/*
+ * Time each path through the decoder on the host.  This is not the
+ * cycle count on a target, but shows when a change makes one of the
+ * paths much slower.
+ */
+static void
+TimePaths(void)
+{
+    enum { LOOPS = 20000 };
+    tCMxFaultRecord record;
+    tCMxDecodeCtx ctx = { OutputPrintf, 0 };
+
+    SetupBusFault();
+    uint64_t start = NowNs();
+    for (uint32_t i = 0; i < LOOPS; i++)
+    {
+        CMx_FaultCapture(&record, g_stack, 0xFFFFFFF9, 0);
+    }
+    uint64_t capture = NowNs() - start;
+
+    start = NowNs();
+    for (uint32_t i = 0; i < LOOPS; i++)
+    {
+        g_outputLen = 0;
+        CMx_FaultRecordDecodeCtx(&ctx, &record);
+    }
+    uint64_t decode = NowNs() - start;
+
+    start = NowNs();
+    for (uint32_t i = 0; i < LOOPS; i++)
+    {
+        SimOutputClear();
+        CMx_FaultDecoderEx(g_stack, 0xFFFFFFF9, 0);
+    }
+    uint64_t full = NowNs() - start;
+
+    printf("  ns per fault: capture %u, decode %u, "
+           "capture and decode %u\n",
+           (unsigned)(capture / LOOPS), (unsigned)(decode / LOOPS),
+           (unsigned)(full / LOOPS));
+}
+
+int
+main(void)
+{
+    TestStackPointer();
+    TestRegisters();
+    TestCodeCapture();
+    TestMpuCapture();
+    TestDecode();
+    TestDecoderEx();
+    TimePaths();
+
+#ifdef SIM_NO_CODE_RANGE
+    printf("host_harness (no code range): %s\n", g_failures ? "FAILED" : "passed");
+#else
+    printf("host_harness: %s\n", g_failures ? "FAILED" : "passed");
+#endif
+    return g_failures ? 1 : 0;
+}
@@ -0,0 +1,146 @@
+/******************************************************************************
+ *
+ * host_sim.h - Simulated Cortex-M memory map for host tests of the fault
+ * decoder
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#ifndef __HOST_SIM_H__
+#define __HOST_SIM_H__
+
+/*
+ * Each test includes this file and then cmx_fault_decoder.c, so that the
+ * register and code reads of the decoder go to the arrays below instead
+ * of the real system control space.  The MPU base and attribute
+ * registers are banked by the region number register like on a real
+ * part.  Code is mapped at SIM_CODE_BASE, and that is the code range
+ * unless SIM_NO_CODE_RANGE is defined.
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SIM_CODE_BASE       0x00001000
+#define SIM_CODE_HALFWORDS  0x100
+
+static uint32_t g_simScs[0x1000 / 4];   // 0xE000E000 - 0xE000EFFF
+static uint32_t g_simDwt[0x10];         // 0xE0001000 - 0xE000103F
+static uint32_t g_simMpuRbar[16];
+static uint32_t g_simMpuRasr[16];
+static uint16_t g_simCode[SIM_CODE_HALFWORDS];
+static uint32_t g_simUnmapped;
+static uint32_t g_simBadReads;
+
+/* Access a system control space register in the simulated map */
+#define SIM_SCS(addr) g_simScs[((addr) - 0xE000E000) / 4]
+
+static inline volatile uint32_t *
+SimReg32(uint32_t addr)
+{
+    if (addr == 0xE000ED9C)
+    {
+        return &g_simMpuRbar[SIM_SCS(0xE000ED98) & 0x0F];
+    }
+    if (addr == 0xE000EDA0)
+    {
+        return &g_simMpuRasr[SIM_SCS(0xE000ED98) & 0x0F];
+    }
+    if ((addr >= 0xE000E000) && (addr < 0xE000F000))
+    {
+        return &SIM_SCS(addr);
+    }
+    if ((addr >= 0xE0001000) && (addr < 0xE0001040))
+    {
+        return &g_simDwt[(addr - 0xE0001000) / 4];
+    }
+    g_simBadReads++;
+    g_simUnmapped = 0;
+    return &g_simUnmapped;
+}
+
+static inline uint16_t
+SimRead16(uint32_t addr)
+{
+    if ((addr < SIM_CODE_BASE)
+     || (addr >= (SIM_CODE_BASE + (SIM_CODE_HALFWORDS * 2))))
+    {
+        g_simBadReads++;
+        return 0;
+    }
+    return g_simCode[(addr - SIM_CODE_BASE) / 2];
+}
+
+/* Clear the whole simulated memory map */
+static inline void
+SimReset(void)
+{
+    memset(g_simScs, 0, sizeof(g_simScs));
+    memset(g_simDwt, 0, sizeof(g_simDwt));
+    memset(g_simMpuRbar, 0, sizeof(g_simMpuRbar));
+    memset(g_simMpuRasr, 0, sizeof(g_simMpuRasr));
+    memset(g_simCode, 0, sizeof(g_simCode));
+    g_simBadReads = 0;
+}
+
+#define CMX_HOST_BUILD
+#define CMX_REG32(addr) (*SimReg32(addr))
+#define CMX_READ16(addr) SimRead16(addr)
+#ifndef SIM_NO_CODE_RANGE
+#define CMX_CODE_START SIM_CODE_BASE
+#define CMX_CODE_END (SIM_CODE_BASE + (SIM_CODE_HALFWORDS * 2))
+#endif
+
+/*
+ * Decoder output that goes to DbgPrintf() is kept in g_simOutput, so
+ * tests can check what the fault handler printed.  Output past the end
+ * of the buffer is dropped.
+ */
+static char g_simOutput[8192];
+static size_t g_simOutputLen;
+
+int
+DbgPrintf(const char *format, ...)
+{
+    va_list args;
+
+    va_start(args, format);
+    int n = vsnprintf(&g_simOutput[g_simOutputLen],
+                      sizeof(g_simOutput) - g_simOutputLen, format, args);
+    va_end(args);
+    if (n > 0)
+    {
+        g_simOutputLen += n;
+        if (g_simOutputLen >= sizeof(g_simOutput))
+        {
+            g_simOutputLen = sizeof(g_simOutput) - 1;
+        }
+    }
+    return n;
+}
+
+/* Throw away the output printed so far */
+static inline void
+SimOutputClear(void)
+{
+    g_simOutputLen = 0;
+    g_simOutput[0] = 0;
+}
+
+/* Count and report failed checks */
+static int g_failures;
+#define CHECK(cond)                                                     \
+    do                                                                  \
+    {                                                                   \
+        if (!(cond))                                                    \
+        {                                                               \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            g_failures++;                                               \
+        }                                                               \
+    } while (0)
+
+#endif
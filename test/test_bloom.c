@@ -0,0 +1,158 @@
+/******************************************************************************
+ *
+ * test_bloom.c - Host tests of the known faults Bloom filter
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#include "host_sim.h"
+#include "cmx_fault_decoder.c"
+
+/* Small random number generator so the test is the same every run */
+static uint32_t g_seed = 54321;
+
+static uint32_t
+Random(void)
+{
+    g_seed = (g_seed * 1103515245) + 12345;
+    return (g_seed >> 16) | (g_seed << 16);
+}
+
+static void
+TestAddCheck(void)
+{
+    static uint32_t bits[1024 / 32];
+    static uint32_t sigs[64];
+    tCMxFaultBloom bloom = { bits, 1024, 11 };
+
+    // An empty filter has nothing in it
+    CHECK(!CMx_FaultBloomCheck(&bloom, 0));
+    CHECK(!CMx_FaultBloomCheck(&bloom, 0xFFFFFFFF));
+
+    // Everything that was added is always found
+    for (uint32_t i = 0; i < 64; i++)
+    {
+        sigs[i] = Random();
+        CMx_FaultBloomAdd(&bloom, sigs[i]);
+        for (uint32_t j = 0; j <= i; j++)
+        {
+            CHECK(CMx_FaultBloomCheck(&bloom, sigs[j]));
+        }
+    }
+
+    // Signatures that were not added are hardly ever found.  The expected
+    // rate is about 1 in 2000, allow 10 times that.
+    uint32_t falsePositives = 0;
+    for (uint32_t i = 0; i < 100000; i++)
+    {
+        if (CMx_FaultBloomCheck(&bloom, Random()))
+        {
+            falsePositives++;
+        }
+    }
+    CHECK(falsePositives < 500);
+
+    // Signatures that only differ in a few bits
+    CMx_FaultBloomAdd(&bloom, 0x12345678);
+    CHECK(CMx_FaultBloomCheck(&bloom, 0x12345678));
+    falsePositives = 0;
+    for (uint32_t b = 0; b < 32; b++)
+    {
+        falsePositives += CMx_FaultBloomCheck(&bloom, 0x12345678 ^ (1U << b));
+    }
+    CHECK(falsePositives <= 1);
+
+    // The smallest filter
+    uint32_t small[1] = { 0 };
+    tCMxFaultBloom tiny = { small, 32, 2 };
+    CMx_FaultBloomAdd(&tiny, 0xCAFEF00D);
+    CHECK(CMx_FaultBloomCheck(&tiny, 0xCAFEF00D));
+}
+
+static void
+TestSetKnown(void)
+{
+    static uint32_t bits[64 / 32];
+    tCMxFaultBloom bloom = { bits, 64, 3 };
+
+    CHECK(CMx_FaultSetKnown(&bloom));
+    CHECK(g_pKnownFaults == &bloom);
+    CHECK(CMx_FaultSetKnown(0));
+    CHECK(g_pKnownFaults == 0);
+
+    // Filters that would index outside of the bit array, or match every
+    // fault, are not used
+    tCMxFaultBloom bad = bloom;
+    bad.numBits = 0;
+    CHECK(!CMx_FaultSetKnown(&bad));
+    CHECK(g_pKnownFaults == 0);
+    bad.numBits = 48;
+    CHECK(!CMx_FaultSetKnown(&bad));
+    bad.numBits = 16;
+    CHECK(!CMx_FaultSetKnown(&bad));
+    bad.numBits = 64;
+    bad.numHashes = 0;
+    CHECK(!CMx_FaultSetKnown(&bad));
+    bad.numHashes = 3;
+    bad.pBits = 0;
+    CHECK(!CMx_FaultSetKnown(&bad));
+
+    // A bad filter also removes the one that was there
+    CHECK(CMx_FaultSetKnown(&bloom));
+    CHECK(!CMx_FaultSetKnown(&bad));
+    CHECK(g_pKnownFaults == 0);
+}
+
+static void
+TestKnownSummary(void)
+{
+    static uint32_t bits[256 / 32];
+    tCMxFaultBloom bloom = { bits, 256, 4 };
+    tCMxFaultRecord record;
+    uint32_t stack[8] = { 0, 0, 0, 0, 0, 0x00001001, 0x00001100, 0x01000000 };
+
+    SimReset();
+    SIM_SCS(0xE000ED04) = CMX_EXC_BUSFAULT;
+    SIM_SCS(0xE000ED28) = 0x00000400;   // IMPRECISERR
+
+    // Not known yet, decoded in full
+    SimOutputClear();
+    CMx_FaultDecoderEx(stack, 0xFFFFFFF9, 0);
+    CHECK(strstr(g_simOutput, "*** BusFault ***") != 0);
+    CHECK(strstr(g_simOutput, "Known fault") == 0);
+
+    // Mark it as known
+    CMx_FaultCapture(&record, stack, 0xFFFFFFF9, 0);
+    uint32_t signature = CMx_FaultSignature(&record);
+    CMx_FaultBloomAdd(&bloom, signature);
+    CHECK(CMx_FaultSetKnown(&bloom));
+
+    SimOutputClear();
+    CMx_FaultDecoderEx(stack, 0xFFFFFFF9, 0);
+    char line[64];
+    snprintf(line, sizeof(line), "*** Known fault %08X (PC 00001100",
+             signature);
+    CHECK(strstr(g_simOutput, line) != 0);
+    CHECK(strstr(g_simOutput, "*** BusFault ***") == 0);
+
+    // A different fault is still decoded in full
+    stack[6] = 0x00001200;
+    SimOutputClear();
+    CMx_FaultDecoderEx(stack, 0xFFFFFFF9, 0);
+    CHECK(strstr(g_simOutput, "*** BusFault ***") != 0);
+
+    CMx_FaultSetKnown(0);
+}
+
+int
+main(void)
+{
+    TestAddCheck();
+    TestSetKnown();
+    TestKnownSummary();
+
+    printf("test_bloom: %s\n", g_failures ? "FAILED" : "passed");
+    return g_failures ? 1 : 0;
+}
@@ -0,0 +1,253 @@
+/******************************************************************************
+ *
+ * test_compress.c - Host tests of compressing packed records against a
+ * dictionary
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <time.h>
+
+#include "host_sim.h"
+#include "cmx_fault_decoder.c"
+
+#define NUM_RECORDS 256
+
+static uint32_t g_records[NUM_RECORDS * CMX_RECORD_WORDS];
+static uint32_t g_dict[CMX_RECORD_WORDS];
+
+/*
+ * Make a batch of packed records that look like a fleet reporting a few
+ * different faults from the same build.
+ */
+static void
+MakeRecords(void)
+{
+    for (uint32_t n = 0; n < NUM_RECORDS; n++)
+    {
+        tCMxFaultRecord record;
+        uint32_t kind = n % 4;
+
+        memset(&record, 0, sizeof(record));
+        record.timestamp = 1000000 + (n * 37);
+        record.buildId = 0x00020001;
+        record.exception = CMX_EXC_BUSFAULT;
+        record.cfsr = (kind == 3) ? 0x00000400 : 0x00008200;
+        record.bfar = 0x40001000 + (kind * 4);
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            record.frame[i] = 0x20001000 + i;
+        }
+        record.frame[0] = n;
+        record.frame[6] = 0x08001000 + (kind * 0x40);
+        record.frame[7] = 0x21000000;
+        record.excReturn = 0xFFFFFFFD;
+        record.sp = 0x20001F80;
+        record.special.psp = 0x20001F60;
+        record.special.msp = 0x20007FE0;
+        record.nvicActive[0] = 1U << kind;
+        CMx_FaultClassify(&record);
+        CMx_FaultRecordPack(&record, &g_records[n * CMX_RECORD_WORDS]);
+    }
+}
+
+static void
+TestRoundTrip(void)
+{
+    uint8_t out[CMX_RECORD_COMPRESSED_MAX];
+    uint32_t unpacked[CMX_RECORD_WORDS];
+
+    CHECK(CMx_RecordDictTrain(g_records, NUM_RECORDS * CMX_RECORD_WORDS,
+                              g_dict) == NUM_RECORDS);
+    CHECK(g_dict[0] == CMX_RECORD_MAGIC);
+    CHECK(g_dict[buildIdOffset] == 0x00020001);
+
+    for (uint32_t n = 0; n < NUM_RECORDS; n++)
+    {
+        const uint32_t *pRecord = &g_records[n * CMX_RECORD_WORDS];
+        uint32_t len = CMx_RecordCompress(pRecord, g_dict, out, sizeof(out));
+        CHECK((len != 0) && (len < 40));
+        memset(unpacked, 0xEE, sizeof(unpacked));
+        CHECK(CMx_RecordDecompress(out, len, g_dict, unpacked,
+                                   CMX_RECORD_WORDS) == CMX_RECORD_WORDS);
+        CHECK(memcmp(unpacked, pRecord, sizeof(unpacked)) == 0);
+    }
+
+    // The same record as the dictionary is just the word count
+    uint32_t len = CMx_RecordCompress(g_dict, g_dict, out, sizeof(out));
+    CHECK(len == 1);
+    CHECK(CMx_RecordDecompress(out, len, g_dict, unpacked,
+                               CMX_RECORD_WORDS) == CMX_RECORD_WORDS);
+    CHECK(memcmp(unpacked, g_dict, sizeof(unpacked)) == 0);
+
+    // An empty sample gives an empty dictionary, which still works
+    uint32_t empty[CMX_RECORD_WORDS];
+    CHECK(CMx_RecordDictTrain(g_records, 0, empty) == 0);
+    CHECK(empty[0] == 0);
+    len = CMx_RecordCompress(g_records, empty, out, sizeof(out));
+    CHECK(CMx_RecordDecompress(out, len, empty, unpacked,
+                               CMX_RECORD_WORDS) == CMX_RECORD_WORDS);
+    CHECK(memcmp(unpacked, g_records, sizeof(unpacked)) == 0);
+}
+
+static void
+TestWorstCase(void)
+{
+    uint32_t record[CMX_RECORD_WORDS];
+    uint32_t dict[CMX_RECORD_WORDS];
+    uint8_t out[CMX_RECORD_COMPRESSED_MAX];
+    uint32_t unpacked[CMX_RECORD_WORDS];
+
+    // Every word differs from the dictionary in the top bit, so every
+    // word takes a 5 byte varint
+    for (uint32_t i = 0; i < CMX_RECORD_WORDS; i++)
+    {
+        record[i] = 0xF0000000 | i;
+        dict[i] = 0;
+    }
+    record[0] = CMX_RECORD_MAGIC;
+    record[1] = (CMX_RECORD_VERSION << 16) | (CMX_RECORD_WORDS * 4);
+    uint32_t len = CMx_RecordCompress(record, dict, out, sizeof(out));
+    CHECK(len != 0);
+    CHECK(len <= CMX_RECORD_COMPRESSED_MAX);
+    CHECK(CMx_RecordDecompress(out, len, dict, unpacked,
+                               CMX_RECORD_WORDS) == CMX_RECORD_WORDS);
+    CHECK(memcmp(unpacked, record, sizeof(record)) == 0);
+
+    // One byte less is not enough for it
+    CHECK(CMx_RecordCompress(record, dict, out, len - 1) == 0);
+    CHECK(CMx_RecordCompress(record, dict, out, 4) == 0);
+}
+
+static void
+TestBadInput(void)
+{
+    uint8_t out[CMX_RECORD_COMPRESSED_MAX];
+    uint32_t unpacked[CMX_RECORD_WORDS + 1];
+    const uint32_t *pRecord = &g_records[5 * CMX_RECORD_WORDS];
+
+    uint32_t len = CMx_RecordCompress(pRecord, g_dict, out, sizeof(out));
+
+    // Cut off in the middle of a varint, or before the word count
+    CHECK(CMx_RecordDecompress(out, 0, g_dict, unpacked, CMX_RECORD_WORDS) == 0);
+    for (uint32_t cut = 1; cut < len; cut++)
+    {
+        uint32_t words = CMx_RecordDecompress(out, cut, g_dict, unpacked,
+                                              CMX_RECORD_WORDS);
+        if (out[cut - 1] & 0x80)
+        {
+            CHECK(words == 0);
+        }
+        else
+        {
+            CHECK((words == 0) || (words == CMX_RECORD_WORDS));
+        }
+    }
+
+    // A varint longer than 5 bytes
+    uint8_t bad[8] = { 0x65, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01, 0x01 };
+    CHECK(CMx_RecordDecompress(bad, sizeof(bad), g_dict, unpacked,
+                               CMX_RECORD_WORDS) == 0);
+
+    // A run of zero words past the end of the record
+    uint8_t longRun[3] = { 0x04, 0x04, 0x01 };
+    CHECK(CMx_RecordDecompress(longRun, sizeof(longRun), g_dict, unpacked,
+                               CMX_RECORD_WORDS) == 0);
+    longRun[1] = 0x03;
+    CHECK(CMx_RecordDecompress(longRun, sizeof(longRun), g_dict, unpacked,
+                               CMX_RECORD_WORDS) == 4);
+
+    // More words than the output can hold, nothing is written past it
+    unpacked[CMX_RECORD_WORDS - 1] = 0xDEADBEEF;
+    CHECK(CMx_RecordDecompress(out, len, g_dict, unpacked,
+                               CMX_RECORD_WORDS - 1) == 0);
+    CHECK(unpacked[CMX_RECORD_WORDS - 1] == 0xDEADBEEF);
+    uint8_t huge[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x0F, 0x00 };
+    CHECK(CMx_RecordDecompress(huge, sizeof(huge), g_dict, unpacked,
+                               CMX_RECORD_WORDS) == 0);
+
+    // Records longer than the dictionary, from a newer version, use 0 for
+    // the words past it
+    uint32_t longer[CMX_RECORD_WORDS + 1];
+    memcpy(longer, pRecord, CMX_RECORD_WORDS * 4);
+    longer[1] = (longer[1] & 0xFFFF0000) | ((CMX_RECORD_WORDS + 1) * 4);
+    longer[CMX_RECORD_WORDS] = 0x12345678;
+    len = CMx_RecordCompress(longer, g_dict, out, sizeof(out));
+    CHECK(CMx_RecordDecompress(out, len, g_dict, unpacked,
+                               CMX_RECORD_WORDS + 1) == CMX_RECORD_WORDS + 1);
+    CHECK(memcmp(unpacked, longer, sizeof(longer)) == 0);
+}
+
+/* Nanoseconds from the monotonic clock */
+static uint64_t
+NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/*
+ * Print the compression ratio of the sample records and how fast they
+ * are compressed and decompressed on the host.  These are figures to
+ * compare between changes, nothing is checked.
+ */
+static void
+MeasureRatio(void)
+{
+    enum { LOOPS = 200 };
+    static uint8_t out[NUM_RECORDS][CMX_RECORD_COMPRESSED_MAX];
+    static uint32_t lens[NUM_RECORDS];
+    uint32_t unpacked[CMX_RECORD_WORDS];
+    uint64_t total = 0;
+
+    uint64_t start = NowNs();
+    for (uint32_t loop = 0; loop < LOOPS; loop++)
+    {
+        for (uint32_t n = 0; n < NUM_RECORDS; n++)
+        {
+            lens[n] = CMx_RecordCompress(&g_records[n * CMX_RECORD_WORDS],
+                                         g_dict, out[n], sizeof(out[n]));
+        }
+    }
+    uint64_t compress = NowNs() - start;
+
+    start = NowNs();
+    for (uint32_t loop = 0; loop < LOOPS; loop++)
+    {
+        for (uint32_t n = 0; n < NUM_RECORDS; n++)
+        {
+            CMx_RecordDecompress(out[n], lens[n], g_dict, unpacked,
+                                 CMX_RECORD_WORDS);
+        }
+    }
+    uint64_t decompress = NowNs() - start;
+
+    for (uint32_t n = 0; n < NUM_RECORDS; n++)
+    {
+        total += lens[n];
+    }
+    double bytes = (double)LOOPS * NUM_RECORDS * CMX_RECORD_WORDS * 4;
+    printf("  %u records, %u bytes packed, %u compressed (%.1fx), "
+           "compress %.2f GB/s, decompress %.2f GB/s\n",
+           NUM_RECORDS, NUM_RECORDS * CMX_RECORD_WORDS * 4, (unsigned)total,
+           (double)(NUM_RECORDS * CMX_RECORD_WORDS * 4) / (double)total,
+           bytes / (double)compress, bytes / (double)decompress);
+}
+
+int
+main(void)
+{
+    MakeRecords();
+    TestRoundTrip();
+    TestWorstCase();
+    TestBadInput();
+    MeasureRatio();
+
+    printf("test_compress: %s\n", g_failures ? "FAILED" : "passed");
+    return g_failures ? 1 : 0;
+}
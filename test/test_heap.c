@@ -0,0 +1,138 @@
+/******************************************************************************
+ *
+ * test_heap.c - Host tests of the heap check in the fault handler
+ *
+ * This is also built with __ARM_ARCH_6M__ defined, to check that the DWT
+ * is left alone on parts that don't have a cycle counter.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#define CMX_HEAP_MAX_BLOCKS 100
+#define CMX_HEAP_BUDGET_CYCLES 1000
+
+#include "host_sim.h"
+#include "cmx_fault_decoder.c"
+
+#if defined(__ARM_ARCH_6M__) || defined(__ARM_ARCH_8M_BASE__)
+#define HAVE_CYCCNT 0
+#else
+#define HAVE_CYCCNT 1
+#endif
+
+/*
+ * Simulated heap of 16 byte blocks at HEAP_START, where every fourth
+ * block is free.  The block at g_badBlock has a bad header, and each
+ * block walked takes g_blockCycles on the cycle counter.
+ */
+#define HEAP_START  0x20000000
+#define HEAP_BLOCKS 40
+
+static uint32_t g_badBlock;
+static uint32_t g_blockCycles;
+
+static bool
+HeapBlock(uint32_t block, uint32_t *pNext, uint32_t *pSize, bool *pFree)
+{
+    g_simDwt[1] += g_blockCycles;
+    if (block == g_badBlock)
+    {
+        return false;
+    }
+    *pNext = block + 16;
+    *pSize = 16;
+    *pFree = (((block - HEAP_START) / 16) % 4) == 3;
+    return true;
+}
+
+static const tCMxHeapAdapter g_heap =
+{
+    HEAP_START, HEAP_START + (HEAP_BLOCKS * 16), HeapBlock
+};
+
+static uint32_t g_stack[8];
+
+static void
+Capture(tCMxFaultRecord *pRecord)
+{
+    g_stack[6] = SIM_CODE_BASE + 0x40;
+    g_stack[7] = 0x01000000;
+    CMx_FaultCapture(pRecord, g_stack, 0xFFFFFFF9, 0);
+}
+
+static void
+TestHeapWalk(void)
+{
+    tCMxFaultRecord record;
+
+    SimReset();
+    CMx_FaultSetHeapAdapter(&g_heap);
+    g_badBlock = 0;
+    g_blockCycles = 10;
+    Capture(&record);
+    CHECK(record.heapStatus == CMX_HEAP_OK);
+    CHECK(record.heapBlocks == HEAP_BLOCKS);
+    CHECK(record.heapUsed == 30 * 16);
+    CHECK(record.heapFree == 10 * 16);
+    CHECK(record.heapLargestFree == 16);
+
+    // The cycle counter is only started where there is one
+    CHECK(((SIM_SCS(0xE000EDFC) & 0x01000000) != 0) == HAVE_CYCCNT);
+    CHECK(((g_simDwt[0] & 1) != 0) == HAVE_CYCCNT);
+
+    // Corrupt block header
+    g_badBlock = HEAP_START + (7 * 16);
+    Capture(&record);
+    CHECK(record.heapStatus == CMX_HEAP_CORRUPT);
+    CHECK(record.heapBadBlock == g_badBlock);
+    CHECK(record.heapBlocks == 7);
+}
+
+static void
+TestHeapBudget(void)
+{
+    tCMxFaultRecord record;
+
+    SimReset();
+    CMx_FaultSetHeapAdapter(&g_heap);
+    g_badBlock = 0;
+
+    // Each block takes 100 cycles, so the budget runs out after 11
+    // blocks.  Without a cycle counter the whole heap is walked.
+    g_blockCycles = 100;
+    Capture(&record);
+#if HAVE_CYCCNT
+    CHECK(record.heapStatus == CMX_HEAP_BUDGET);
+    CHECK(record.heapBlocks == 11);
+    CHECK(record.heapBadBlock == HEAP_START + (11 * 16));
+#else
+    CHECK(record.heapStatus == CMX_HEAP_OK);
+    CHECK(record.heapBlocks == HEAP_BLOCKS);
+    CHECK(g_simDwt[0] == 0);
+#endif
+
+    // The block limit applies everywhere
+    static const tCMxHeapAdapter bigHeap =
+    {
+        HEAP_START, HEAP_START + (1000 * 16), HeapBlock
+    };
+    CMx_FaultSetHeapAdapter(&bigHeap);
+    g_blockCycles = 0;
+    Capture(&record);
+    CHECK(record.heapStatus == CMX_HEAP_BUDGET);
+    CHECK(record.heapBlocks == CMX_HEAP_MAX_BLOCKS);
+    CMx_FaultSetHeapAdapter(0);
+}
+
+int
+main(void)
+{
+    TestHeapWalk();
+    TestHeapBudget();
+
+    printf("test_heap%s: %s\n", HAVE_CYCCNT ? "" : " (ARMv6-M)",
+           g_failures ? "FAILED" : "passed");
+    return g_failures ? 1 : 0;
+}
@@ -0,0 +1,238 @@
+/******************************************************************************
+ *
+ * test_log.c - Host tests of the retained fault log and storm suppression
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#define CMX_FAULT_LOG
+#define CMX_FAULT_LOG_ENTRIES 2
+#define CMX_FAULT_STORM_THRESHOLD 3
+#define CMX_FAULT_STORM_WINDOW 100
+#define CMX_FAULT_HISTORY_BYTES 14
+
+#include "host_sim.h"
+#include "cmx_fault_decoder.c"
+
+/* Make a record for a fault at the given PC, time and severity */
+static tCMxFaultRecord
+MakeRecord(uint32_t pc, uint32_t timestamp, uint32_t severity)
+{
+    tCMxFaultRecord record;
+
+    memset(&record, 0, sizeof(record));
+    record.frame[5] = 0x00001001;
+    record.frame[6] = pc;
+    record.cfsr = 0x00008200;
+    record.timestamp = timestamp;
+    record.severity = severity;
+    return record;
+}
+
+static void
+TestStormWindow(void)
+{
+    CMx_FaultLogClear();
+
+    // Four in quick succession, the fourth is over the threshold
+    tCMxFaultRecord record = MakeRecord(0x00001100, 1000, CMX_SEVERITY_MEDIUM);
+    tCMxFaultLogEntry *pEntry = 0;
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        record.timestamp = 1000 + (i * 10);
+        pEntry = CMx_FaultLogAdd(&record);
+        CHECK(pEntry != 0);
+        CHECK(pEntry->windowCount == i + 1);
+    }
+    CHECK(pEntry->windowCount > CMX_FAULT_STORM_THRESHOLD);
+    CHECK(pEntry->windowStart == 1000);
+
+    // Still in the window
+    record.timestamp = 1099;
+    pEntry = CMx_FaultLogAdd(&record);
+    CHECK(pEntry->windowCount == 5);
+
+    // The window has passed, so this starts a new one and the count over
+    // the whole life of the entry keeps going
+    record.timestamp = 1100;
+    pEntry = CMx_FaultLogAdd(&record);
+    CHECK(pEntry->windowStart == 1100);
+    CHECK(pEntry->windowCount == 1);
+    CHECK(pEntry->count == 6);
+
+    // The same fault once in a while is never suppressed
+    for (uint32_t i = 1; i <= 10; i++)
+    {
+        record.timestamp = 1100 + (i * 150);
+        pEntry = CMx_FaultLogAdd(&record);
+        CHECK(pEntry->windowCount == 1);
+    }
+    CHECK(pEntry->count == 16);
+
+    // Timestamps that wrap around
+    CMx_FaultLogClear();
+    record.timestamp = 0xFFFFFFF0;
+    CMx_FaultLogAdd(&record);
+    record.timestamp = 0x00000010;
+    pEntry = CMx_FaultLogAdd(&record);
+    CHECK(pEntry->windowCount == 2);
+    record.timestamp = 0x00000060;
+    pEntry = CMx_FaultLogAdd(&record);
+    CHECK(pEntry->windowCount == 1);
+}
+
+static void
+TestReplace(void)
+{
+    CMx_FaultLogClear();
+
+    tCMxFaultRecord low = MakeRecord(0x00001100, 0, CMX_SEVERITY_LOW);
+    tCMxFaultRecord high = MakeRecord(0x00001200, 0, CMX_SEVERITY_HIGH);
+    tCMxFaultRecord mid = MakeRecord(0x00001300, 0, CMX_SEVERITY_MEDIUM);
+    tCMxFaultRecord least = MakeRecord(0x00001400, 0, CMX_SEVERITY_INFO);
+
+    CHECK(CMx_FaultLogAdd(&low) != 0);
+    CHECK(CMx_FaultLogAdd(&high) != 0);
+
+    // The log is full and nothing was sent, the least severe entry goes
+    tCMxFaultLogEntry *pEntry = CMx_FaultLogAdd(&mid);
+    CHECK((pEntry != 0) && (pEntry->record.frame[6] == 0x00001300));
+
+    // A less severe fault does not replace an unsent entry
+    CHECK(CMx_FaultLogAdd(&least) == 0);
+    CHECK(CMx_FaultLogGet()->total == 4);
+
+    // Once an entry was sent it can be replaced by anything
+    CMx_FaultLogMarkSent(CMx_FaultLogNextToSend());
+    pEntry = CMx_FaultLogAdd(&least);
+    CHECK((pEntry != 0) && (pEntry->record.frame[6] == 0x00001400));
+    CHECK(CMx_FaultLogNextToSend()->record.frame[6] == 0x00001300);
+}
+
+static void
+TestHistory(void)
+{
+    tCMxFaultEvent event;
+    uint32_t offset;
+
+    CMx_FaultLogClear();
+
+    // The smallest history holds one event of the largest size
+    tCMxFaultRecord record = MakeRecord(0x00001100, 0x80000000, CMX_SEVERITY_LOW);
+    record.buildId = 0x7FFFFFFF;
+    CMx_FaultLogAdd(&record);
+    CHECK(CMx_FaultLogGet()->histLen == 14);
+    offset = 0;
+    CHECK(CMx_FaultHistoryRead(CMx_FaultLogGet(), &offset, &event));
+    CHECK((event.time == 0x80000000) && (event.buildId == 0x7FFFFFFF));
+    CHECK(event.signature == CMx_FaultSignature(&record));
+    CHECK(!CMx_FaultHistoryRead(CMx_FaultLogGet(), &offset, &event));
+
+    // Another one replaces it
+    record.timestamp = 0;
+    record.buildId = 0x80000000;
+    CMx_FaultLogAdd(&record);
+    CHECK(CMx_FaultLogGet()->histLen == 10);
+    offset = 0;
+    CHECK(CMx_FaultHistoryRead(CMx_FaultLogGet(), &offset, &event));
+    CHECK((event.time == 0) && (event.buildId == 0x80000000));
+    CHECK(!CMx_FaultHistoryRead(CMx_FaultLogGet(), &offset, &event));
+
+    // Small events share the space
+    record.timestamp = 1;
+    CMx_FaultLogAdd(&record);
+    record.timestamp = 2;
+    CMx_FaultLogAdd(&record);
+    CHECK(CMx_FaultLogGet()->histLen == 12);
+    offset = 0;
+    CHECK(CMx_FaultHistoryRead(CMx_FaultLogGet(), &offset, &event));
+    CHECK(event.time == 1);
+    CHECK(CMx_FaultHistoryRead(CMx_FaultLogGet(), &offset, &event));
+    CHECK((event.time == 2) && (event.buildId == 0x80000000));
+    CHECK(!CMx_FaultHistoryRead(CMx_FaultLogGet(), &offset, &event));
+}
+
+/* Time source for the decoder, returns g_now */
+static uint32_t g_now;
+
+static uint32_t
+TestTime(void)
+{
+    return g_now;
+}
+
+static void
+TestStormSummary(void)
+{
+    uint32_t stack[8] = { 0, 0, 0, 0, 0, 0x00001001, 0x00001100, 0x01000000 };
+
+    SimReset();
+    CMx_FaultLogClear();
+    CMx_FaultSetTimeSource(TestTime);
+    SIM_SCS(0xE000ED04) = CMX_EXC_BUSFAULT;
+    SIM_SCS(0xE000ED28) = 0x00000400;   // IMPRECISERR
+
+    // Decoded in full up to the threshold, then summarized
+    for (uint32_t i = 0; i < 5; i++)
+    {
+        g_now = 500 + i;
+        SimOutputClear();
+        CMx_FaultDecoderEx(stack, 0xFFFFFFF9, 0);
+        bool summary = strstr(g_simOutput, "repeated") != 0;
+        CHECK(summary == (i >= CMX_FAULT_STORM_THRESHOLD));
+        CHECK((strstr(g_simOutput, "*** BusFault ***") != 0) == !summary);
+    }
+    CHECK(strstr(g_simOutput, "repeated 5 times, 5 since time 500") != 0);
+
+    // Decoded in full again once the window has passed
+    g_now = 600;
+    SimOutputClear();
+    CMx_FaultDecoderEx(stack, 0xFFFFFFF9, 0);
+    CHECK(strstr(g_simOutput, "repeated") == 0);
+    CHECK(CMx_FaultLogGet()->entries[0].count == 6);
+
+    CMx_FaultSetTimeSource(0);
+}
+
+static void
+TestLayout(void)
+{
+    tCMxFaultRecord record = MakeRecord(0x00001100, 10, CMX_SEVERITY_LOW);
+
+    // A log written by the same firmware is kept
+    CMx_FaultLogClear();
+    CMx_FaultLogAdd(&record);
+    CHECK(CMx_FaultLogGet()->total == 1);
+
+    // A log from firmware with a different layout or configuration is
+    // cleared, even though the magic is right
+    g_faultLog.layout ^= 4;
+    CHECK(CMx_FaultLogGet()->total == 0);
+    CHECK(CMx_FaultLogGet()->entries[0].count == 0);
+
+    CMx_FaultLogAdd(&record);
+    g_faultLog.config ^= 1 << 24;
+    CHECK(CMx_FaultLogGet()->total == 0);
+
+    // An older log without the layout fields has the count of faults
+    // where the layout is now
+    CMx_FaultLogAdd(&record);
+    g_faultLog.layout = 1;
+    CHECK(CMx_FaultLogGet()->total == 0);
+    CHECK(g_faultLog.magic == CMX_FAULT_LOG_MAGIC);
+}
+
+int
+main(void)
+{
+    TestStormWindow();
+    TestReplace();
+    TestHistory();
+    TestStormSummary();
+    TestLayout();
+
+    printf("test_log: %s\n", g_failures ? "FAILED" : "passed");
+    return g_failures ? 1 : 0;
+}
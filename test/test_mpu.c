@@ -0,0 +1,156 @@
+/******************************************************************************
+ *
+ * test_mpu.c - Host tests of MPU region matching
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#include "host_sim.h"
+#include "cmx_fault_decoder.c"
+
+/* Attribute register value of an enabled region of 2^(sizeBits) bytes */
+#define RASR(sizeBits, srd) \
+    ((((sizeBits) - 1) << MPU_RASR_SIZE_S) | ((srd) << MPU_RASR_SRD_S) \
+     | MPU_RASR_ENABLE)
+
+static void
+SetRegion(tCMxFaultRecord *pRecord, uint32_t region, uint32_t base,
+          uint32_t rasr)
+{
+    pRecord->mpuRbar[region] = base | 0x10 | region;
+    pRecord->mpuRasr[region] = rasr;
+}
+
+static void
+InitRecord(tCMxFaultRecord *pRecord, uint32_t regions)
+{
+    memset(pRecord, 0, sizeof(*pRecord));
+    pRecord->mpuType = regions << MPU_TYPE_DREGION_S;
+    pRecord->mpuCtrl = 0x5;
+}
+
+static void
+TestOverlap(void)
+{
+    tCMxFaultRecord record;
+    InitRecord(&record, 8);
+
+    // Flash, all of SRAM, and a 1KB guard region in the middle of SRAM
+    SetRegion(&record, 0, 0x00000000, RASR(20, 0));
+    SetRegion(&record, 1, 0x20000000, RASR(16, 0));
+    SetRegion(&record, 5, 0x20004000, RASR(10, 0));
+
+    CHECK(CMx_FaultMpuMatch(&record, 0x00000000) == 0);
+    CHECK(CMx_FaultMpuMatch(&record, 0x000FFFFF) == 0);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20000000) == 1);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20003FFF) == 1);
+
+    // The highest numbered region wins where regions overlap
+    CHECK(CMx_FaultMpuMatch(&record, 0x20004000) == 5);
+    CHECK(CMx_FaultMpuMatch(&record, 0x200043FF) == 5);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20004400) == 1);
+
+    // A disabled region does not match even if it is higher
+    record.mpuRasr[5] &= ~MPU_RASR_ENABLE;
+    CHECK(CMx_FaultMpuMatch(&record, 0x20004000) == 1);
+
+    // Regions past the number the MPU implements are ignored
+    SetRegion(&record, 5, 0x20004000, RASR(10, 0));
+    record.mpuType = 4 << MPU_TYPE_DREGION_S;
+    CHECK(CMx_FaultMpuMatch(&record, 0x20004000) == 1);
+}
+
+static void
+TestSubregions(void)
+{
+    tCMxFaultRecord record;
+    InitRecord(&record, 8);
+
+    // 64KB region over SRAM, 8KB subregion 2 disabled, so that the
+    // region below it shows through
+    SetRegion(&record, 0, 0x20000000, RASR(17, 0));
+    SetRegion(&record, 3, 0x20000000, RASR(16, 0x04));
+
+    CHECK(CMx_FaultMpuMatch(&record, 0x20000000) == 3);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20003FFF) == 3);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20004000) == 0);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20005FFF) == 0);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20006000) == 3);
+    CHECK(CMx_FaultMpuMatch(&record, 0x2000FFFF) == 3);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20010000) == 0);
+
+    // All subregions disabled, nothing left of the region
+    record.mpuRasr[3] = RASR(16, 0xFF);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20008000) == 0);
+}
+
+static void
+TestSmallRegions(void)
+{
+    tCMxFaultRecord record;
+    InitRecord(&record, 8);
+
+    // 256 bytes is the smallest region with subregions, 32 bytes each
+    SetRegion(&record, 2, 0x20000100, RASR(8, 0x81));
+    CHECK(CMx_FaultMpuMatch(&record, 0x20000100) == -1);
+    CHECK(CMx_FaultMpuMatch(&record, 0x2000011F) == -1);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20000120) == 2);
+    CHECK(CMx_FaultMpuMatch(&record, 0x200001DF) == 2);
+    CHECK(CMx_FaultMpuMatch(&record, 0x200001E0) == -1);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20000200) == -1);
+
+    // Below 256 bytes the subregion bits are ignored
+    SetRegion(&record, 2, 0x20000100, RASR(7, 0xFF));
+    CHECK(CMx_FaultMpuMatch(&record, 0x20000100) == 2);
+    CHECK(CMx_FaultMpuMatch(&record, 0x2000017F) == 2);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20000180) == -1);
+
+    // 32 bytes is the smallest region
+    SetRegion(&record, 2, 0x20000100, RASR(5, 0));
+    CHECK(CMx_FaultMpuMatch(&record, 0x200000FF) == -1);
+    CHECK(CMx_FaultMpuMatch(&record, 0x2000011F) == 2);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20000120) == -1);
+}
+
+static void
+TestBackground(void)
+{
+    tCMxFaultRecord record;
+
+    // No regions at all
+    InitRecord(&record, 0);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20000000) == -1);
+
+    // Address outside of all regions
+    InitRecord(&record, 8);
+    SetRegion(&record, 0, 0x00000000, RASR(20, 0));
+    SetRegion(&record, 1, 0x20000000, RASR(16, 0));
+    CHECK(CMx_FaultMpuMatch(&record, 0x00100000) == -1);
+    CHECK(CMx_FaultMpuMatch(&record, 0x1FFFFFFF) == -1);
+    CHECK(CMx_FaultMpuMatch(&record, 0x20010000) == -1);
+    CHECK(CMx_FaultMpuMatch(&record, 0xE000ED28) == -1);
+
+    // A 4GB region covers everything without overflowing the mask
+    SetRegion(&record, 7, 0x00000000, RASR(32, 0));
+    CHECK(CMx_FaultMpuMatch(&record, 0xE000ED28) == 7);
+    CHECK(CMx_FaultMpuMatch(&record, 0xFFFFFFFF) == 7);
+
+    // 4GB region with the top 512MB subregion disabled
+    record.mpuRasr[7] = RASR(32, 0x80);
+    CHECK(CMx_FaultMpuMatch(&record, 0xE000ED28) == -1);
+    CHECK(CMx_FaultMpuMatch(&record, 0x40000000) == 7);
+}
+
+int
+main(void)
+{
+    TestOverlap();
+    TestSubregions();
+    TestSmallRegions();
+    TestBackground();
+
+    printf("test_mpu: %s\n", g_failures ? "FAILED" : "passed");
+    return g_failures ? 1 : 0;
+}
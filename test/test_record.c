@@ -0,0 +1,270 @@
+/******************************************************************************
+ *
+ * test_record.c - Host tests of packed fault records
+ *
+ * This is also built with CMX_CODE_HALFWORDS set to 4 and 12, to check
+ * that the packed code field is the same whatever the configuration.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#include "host_sim.h"
+#include "cmx_fault_decoder.c"
+
+/* Address of the first captured halfword, and the PC in it */
+#define CODE_ADDR   (SIM_CODE_BASE + 0x100)
+#define CODE_PC     (CODE_ADDR + ((CMX_CODE_HALFWORDS - 2) * 2))
+
+/* Fill a record with a different value in every field */
+static void
+FillRecord(tCMxFaultRecord *pRecord)
+{
+    memset(pRecord, 0, sizeof(*pRecord));
+    pRecord->timestamp = 1000;
+    pRecord->buildId = 0xB0010002;
+    pRecord->faultClass = CMX_CLASS_NULLPTR;
+    pRecord->severity = CMX_SEVERITY_HIGH;
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        pRecord->frame[i] = 0x100 + i;
+    }
+    pRecord->frame[6] = CODE_PC;
+    pRecord->excReturn = 0xFFFFFFFD;
+    pRecord->sp = 0x20001020;
+    pRecord->exception = CMX_EXC_MEMMANAGE;
+    pRecord->cfsr = 0x00000082;
+    pRecord->hfsr = 0x40000000;
+    pRecord->mmfar = 0x20004000;
+    pRecord->bfar = 0x20004000;
+    pRecord->codeAddr = CODE_ADDR;
+    for (uint32_t i = 0; i < CMX_CODE_HALFWORDS; i++)
+    {
+        pRecord->code[i] = 0x4600 + i;
+    }
+    pRecord->mpuType = CMX_MPU_REGIONS << 8;
+    pRecord->mpuCtrl = 5;
+    for (uint32_t i = 0; i < CMX_MPU_REGIONS; i++)
+    {
+        pRecord->mpuRbar[i] = 0x20000010 + (i * 0x1000) + i;
+        pRecord->mpuRasr[i] = 0x03000021 + (i << 1);
+    }
+    pRecord->special.control = 2;
+    pRecord->special.primask = 1;
+    pRecord->special.basepri = 0x40;
+    pRecord->special.faultmask = 0;
+    pRecord->special.psp = 0x20001000;
+    pRecord->special.msp = 0x20008000;
+    for (uint32_t i = 0; i < CMX_NVIC_WORDS; i++)
+    {
+        pRecord->nvicPending[i] = 0x11 << i;
+        pRecord->nvicActive[i] = 0x22 << i;
+    }
+    pRecord->numStacks = 3;
+    pRecord->stackOverflow = 0x4;
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        pRecord->stackHeadroom[i] = 64 * (i + 1);
+    }
+    pRecord->heapStatus = CMX_HEAP_OK;
+    pRecord->heapBadBlock = 0;
+    pRecord->heapBlocks = 12;
+    pRecord->heapUsed = 300;
+    pRecord->heapFree = 100;
+    pRecord->heapLargestFree = 64;
+}
+
+static void
+TestRoundTrip(void)
+{
+    tCMxFaultRecord record;
+    tCMxFaultRecord unpacked;
+    uint32_t packed[CMX_RECORD_WORDS];
+
+    FillRecord(&record);
+    CHECK(CMx_FaultRecordPack(&record, packed) == CMX_RECORD_WORDS * 4);
+    CHECK(packed[0] == CMX_RECORD_MAGIC);
+    CHECK(packed[1] == ((CMX_RECORD_VERSION << 16) | (CMX_RECORD_WORDS * 4)));
+
+    // Fields read straight from the packed record
+    CHECK(CMx_Record_timestamp(packed, 0) == 1000);
+    CHECK(CMx_Record_buildId(packed, 0) == 0xB0010002);
+    CHECK(CMx_Record_frame(packed, 6) == CODE_PC);
+    CHECK(CMx_Record_frame(packed, 8) == 0);
+    CHECK(CMx_Record_cfsr(packed, 0) == 0x00000082);
+    CHECK(CMx_Record_mpuRbar(packed, 1) == 0x20001011);
+    CHECK(CMx_Record_heap(packed, 3) == 300);
+
+    // No LOG field outside of the fault log
+    CHECK(!(packed[2] & (1UL << CMX_FIELD_LOG)));
+    CHECK(CMx_Record_log(packed, 0) == 0);
+
+    // Everything comes back unless there are code halfwords that don't
+    // fit in the packed record (see TestCode())
+    CHECK(CMx_FaultRecordUnpack(packed, &unpacked));
+#if CMX_CODE_HALFWORDS <= 8
+    CHECK(memcmp(&record, &unpacked, sizeof(record)) == 0);
+#endif
+
+    CHECK(unpacked.timestamp == record.timestamp);
+    CHECK(unpacked.buildId == record.buildId);
+    CHECK(unpacked.faultClass == record.faultClass);
+    CHECK(unpacked.severity == record.severity);
+    CHECK(memcmp(unpacked.frame, record.frame, sizeof(record.frame)) == 0);
+    CHECK(unpacked.excReturn == record.excReturn);
+    CHECK(unpacked.sp == record.sp);
+    CHECK(unpacked.exception == record.exception);
+    CHECK(unpacked.cfsr == record.cfsr);
+    CHECK(unpacked.hfsr == record.hfsr);
+    CHECK(unpacked.mmfar == record.mmfar);
+    CHECK(unpacked.bfar == record.bfar);
+    CHECK(unpacked.codeAddr == record.codeAddr);
+    CHECK(unpacked.mpuType == record.mpuType);
+    CHECK(unpacked.mpuCtrl == record.mpuCtrl);
+    CHECK(memcmp(unpacked.mpuRbar, record.mpuRbar, sizeof(record.mpuRbar)) == 0);
+    CHECK(memcmp(unpacked.mpuRasr, record.mpuRasr, sizeof(record.mpuRasr)) == 0);
+    CHECK(memcmp(&unpacked.special, &record.special, sizeof(record.special)) == 0);
+    CHECK(memcmp(unpacked.nvicPending, record.nvicPending,
+                 sizeof(record.nvicPending)) == 0);
+    CHECK(memcmp(unpacked.nvicActive, record.nvicActive,
+                 sizeof(record.nvicActive)) == 0);
+    CHECK(unpacked.numStacks == record.numStacks);
+    CHECK(unpacked.stackOverflow == record.stackOverflow);
+    CHECK(memcmp(unpacked.stackHeadroom, record.stackHeadroom,
+                 sizeof(record.stackHeadroom)) == 0);
+    CHECK(unpacked.heapStatus == record.heapStatus);
+    CHECK(unpacked.heapBlocks == record.heapBlocks);
+    CHECK(unpacked.heapLargestFree == record.heapLargestFree);
+
+    // Not a packed record
+    packed[0] = 0;
+    CHECK(!CMx_FaultRecordUnpack(packed, &unpacked));
+}
+
+static void
+TestCode(void)
+{
+    tCMxFaultRecord record;
+    tCMxFaultRecord unpacked;
+    uint32_t packed[CMX_RECORD_WORDS];
+
+    // The packed code is always the 8 halfwords up to and after the PC,
+    // with the PC in halfword 6, however many halfwords are captured
+    FillRecord(&record);
+    CMx_FaultRecordPack(&record, packed);
+    CHECK(CMx_Record_codeAddr(packed, 0) == CODE_PC - 12);
+    CHECK((CMx_Record_code(packed, 3) & 0xFFFF)
+          == record.code[CMX_CODE_HALFWORDS - 2]);
+    CHECK((CMx_Record_code(packed, 3) >> 16)
+          == record.code[CMX_CODE_HALFWORDS - 1]);
+    for (int32_t i = 0; i < 8; i++)
+    {
+        int32_t src = i + CMX_CODE_HALFWORDS - 8;
+        uint32_t half = (CMx_Record_code(packed, i / 2) >> ((i & 1) * 16)) & 0xFFFF;
+        CHECK(half == ((src >= 0) ? record.code[src] : 0));
+    }
+
+    // Halfwords that did not fit in the packed record come back as 0
+    CMx_FaultRecordUnpack(packed, &unpacked);
+    CHECK(unpacked.codeAddr == CODE_ADDR);
+    for (int32_t i = 0; i < CMX_CODE_HALFWORDS; i++)
+    {
+        int32_t packedIndex = i - (CMX_CODE_HALFWORDS - 8);
+        CHECK(unpacked.code[i] == ((packedIndex >= 0) ? record.code[i] : 0));
+    }
+
+    // No code captured, no code fields
+    record.codeAddr = 0;
+    CMx_FaultRecordPack(&record, packed);
+    CHECK(!(packed[2] & (1UL << CMX_FIELD_CODE_ADDR)));
+    CHECK(!(packed[2] & (1UL << CMX_FIELD_CODE)));
+    CMx_FaultRecordUnpack(packed, &unpacked);
+    CHECK(unpacked.codeAddr == 0);
+    CHECK(unpacked.code[CMX_CODE_HALFWORDS - 2] == 0);
+}
+
+static void
+TestMissingFields(void)
+{
+    tCMxFaultRecord record;
+    tCMxFaultRecord unpacked;
+    uint32_t packed[CMX_RECORD_WORDS];
+
+    // Fields that were not captured are not present and read as 0
+    FillRecord(&record);
+    record.exception = CMX_EXC_BUSFAULT;
+    record.mpuType = 0;
+    record.excReturn = 0;
+    record.numStacks = 0;
+    record.heapStatus = CMX_HEAP_NOT_CHECKED;
+    CMx_FaultRecordPack(&record, packed);
+    CHECK(!(packed[2] & (1UL << CMX_FIELD_MPU_TYPE)));
+    CHECK(!(packed[2] & (1UL << CMX_FIELD_SPECIAL)));
+    CHECK(!(packed[2] & (1UL << CMX_FIELD_HEAP)));
+
+    // Even if the words have something in them
+    packed[mpuRbarOffset] = 0x12345678;
+    packed[specialOffset + 5] = 0x20008000;
+    CHECK(CMx_Record_mpuRbar(packed, 0) == 0);
+    CHECK(CMx_Record_special(packed, 5) == 0);
+    CMx_FaultRecordUnpack(packed, &unpacked);
+    CHECK(unpacked.mpuRbar[0] == 0);
+    CHECK(unpacked.special.msp == 0);
+    CHECK(unpacked.excReturn == 0);
+    CHECK(unpacked.numStacks == 0);
+    CHECK(unpacked.heapStatus == CMX_HEAP_NOT_CHECKED);
+    CHECK(unpacked.cfsr == record.cfsr);
+}
+
+static void
+TestOldVersions(void)
+{
+    tCMxFaultRecord record;
+    tCMxFaultRecord unpacked;
+    uint32_t packed[CMX_RECORD_WORDS];
+
+    // A version 1 record ends before BUILD_ID.  The presence bit and the
+    // word past the end are garbage here, and must still read as 0.
+    FillRecord(&record);
+    CMx_FaultRecordPack(&record, packed);
+    packed[1] = (1 << 16) | (buildIdOffset * 4);
+    packed[2] |= 1UL << CMX_FIELD_LOG;
+    packed[logOffset] = 0x55555555;
+    CHECK(CMx_Record_buildId(packed, 0) == 0);
+    CHECK(CMx_Record_log(packed, 0) == 0);
+    CHECK(CMx_Record_heap(packed, 5) == 64);
+    CHECK(CMx_FaultRecordUnpack(packed, &unpacked));
+    CHECK(unpacked.buildId == 0);
+    CHECK(unpacked.timestamp == 1000);
+    CHECK(unpacked.heapLargestFree == 64);
+    CHECK(unpacked.codeAddr == CODE_ADDR);
+
+    // A version 2 record has BUILD_ID but not LOG
+    packed[1] = (2 << 16) | (logOffset * 4);
+    CHECK(CMx_Record_buildId(packed, 0) == 0xB0010002);
+    CHECK(CMx_Record_log(packed, 0) == 0);
+    CHECK(CMx_Record_log(packed, 1) == 0);
+
+    // A record that ends in the middle of a field
+    packed[1] = (3 << 16) | ((heapOffset + 2) * 4);
+    CHECK(CMx_Record_heap(packed, 1) == 0);
+    CHECK(CMx_Record_heap(packed, 2) == 0);
+    CHECK(CMx_Record_buildId(packed, 0) == 0);
+    CMx_FaultRecordUnpack(packed, &unpacked);
+    CHECK(unpacked.heapStatus == CMX_HEAP_OK);
+    CHECK(unpacked.heapBlocks == 0);
+}
+
+int
+main(void)
+{
+    TestRoundTrip();
+    TestCode();
+    TestMissingFields();
+    TestOldVersions();
+
+    printf("test_record (%u code halfwords): %s\n", CMX_CODE_HALFWORDS,
+           g_failures ? "FAILED" : "passed");
+    return g_failures ? 1 : 0;
+}
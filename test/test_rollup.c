@@ -0,0 +1,245 @@
+/******************************************************************************
+ *
+ * test_rollup.c - Host tests of counting and merging fault signatures
+ *
+ * This is also built with CMX_STABLE_SIGNATURE defined, where
+ * CMx_FaultBatchSignature() is still there but computes nothing.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#include <stdlib.h>
+
+#include "host_sim.h"
+#include "cmx_fault_decoder.c"
+
+#define MAX_SIGS 1000
+
+/* Small random number generator so the test is the same every run */
+static uint32_t g_seed = 12345;
+
+static uint32_t
+Random(void)
+{
+    g_seed = (g_seed * 1103515245) + 12345;
+    return g_seed >> 8;
+}
+
+static int
+CompareU32(const void *pA, const void *pB)
+{
+    uint32_t a = *(const uint32_t *)pA;
+    uint32_t b = *(const uint32_t *)pB;
+    return (a > b) - (a < b);
+}
+
+/*
+ * Check CMx_SignatureRollup() against sorting with qsort() and counting.
+ *
+ * @return the number of unique signatures
+ */
+static uint32_t
+CheckRollup(const uint32_t *pSigs, uint32_t count)
+{
+    uint32_t sigs[MAX_SIGS];
+    uint32_t counts[MAX_SIGS];
+    uint32_t sorted[MAX_SIGS];
+
+    memcpy(sigs, pSigs, count * 4);
+    memcpy(sorted, pSigs, count * 4);
+    qsort(sorted, count, 4, CompareU32);
+
+    uint32_t unique = CMx_SignatureRollup(sigs, count, counts);
+    uint32_t pos = 0;
+    uint32_t total = 0;
+    for (uint32_t i = 0; i < unique; i++)
+    {
+        CHECK(sigs[i] == sorted[pos]);
+        CHECK((i == 0) || (sigs[i] > sigs[i - 1]));
+        CHECK(counts[i] != 0);
+        for (uint32_t j = 0; j < counts[i]; j++)
+        {
+            CHECK(sorted[pos + j] == sigs[i]);
+        }
+        pos += counts[i];
+        total += counts[i];
+    }
+    CHECK(total == count);
+    return unique;
+}
+
+static void
+TestRollup(void)
+{
+    uint32_t sigs[MAX_SIGS];
+    uint32_t counts[MAX_SIGS];
+
+    // Empty and single batches
+    CHECK(CMx_SignatureRollup(sigs, 0, counts) == 0);
+    sigs[0] = 0xFFFFFFFF;
+    CHECK(CMx_SignatureRollup(sigs, 1, counts) == 1);
+    CHECK((sigs[0] == 0xFFFFFFFF) && (counts[0] == 1));
+
+    // All the same
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        sigs[i] = 0xABCD0000;
+    }
+    CHECK(CheckRollup(sigs, 100) == 1);
+
+    // Already sorted, reversed, and the extreme values
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        sigs[i] = i / 3;
+    }
+    CHECK(CheckRollup(sigs, 100) == 34);
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        sigs[i] = 0xFFFFFFFF - (i / 2);
+    }
+    CHECK(CheckRollup(sigs, 100) == 50);
+    uint32_t edges[5] = { 0xFFFFFFFF, 0, 0x80000000, 0, 0xFFFFFFFF };
+    CHECK(CheckRollup(edges, 5) == 3);
+
+    // Random batches with lots of duplicates, like a fleet with a few
+    // common faults
+    for (uint32_t size = 2; size <= MAX_SIGS; size = (size * 3) + 1)
+    {
+        for (uint32_t i = 0; i < size; i++)
+        {
+            sigs[i] = (Random() % 8 == 0) ? Random() : (Random() % 16) * 0x1000193;
+        }
+        CheckRollup(sigs, size);
+    }
+}
+
+static void
+TestMerge(void)
+{
+    uint32_t sigA[4] = { 10, 20, 30, 40 };
+    uint32_t countA[4] = { 1, 2, 3, 4 };
+    uint32_t sigB[3] = { 5, 20, 25 };
+    uint32_t countB[3] = { 10, 20, 30 };
+    uint32_t sigOut[8];
+    uint32_t countOut[8];
+
+    // Both empty
+    CHECK(CMx_SignatureMerge(sigA, countA, 0, sigB, countB, 0,
+                             sigOut, countOut) == 0);
+
+    // One run empty, the other is copied
+    CHECK(CMx_SignatureMerge(sigA, countA, 4, sigB, countB, 0,
+                             sigOut, countOut) == 4);
+    CHECK(memcmp(sigOut, sigA, sizeof(sigA)) == 0);
+    CHECK(memcmp(countOut, countA, sizeof(countA)) == 0);
+    CHECK(CMx_SignatureMerge(sigA, countA, 0, sigB, countB, 3,
+                             sigOut, countOut) == 3);
+    CHECK(memcmp(sigOut, sigB, sizeof(sigB)) == 0);
+    CHECK(memcmp(countOut, countB, sizeof(countB)) == 0);
+
+    // B runs out first, and the rest of A is copied.  20 is in both.
+    static const uint32_t expSig[6] = { 5, 10, 20, 25, 30, 40 };
+    static const uint32_t expCount[6] = { 10, 1, 22, 30, 3, 4 };
+    CHECK(CMx_SignatureMerge(sigA, countA, 4, sigB, countB, 3,
+                             sigOut, countOut) == 6);
+    CHECK(memcmp(sigOut, expSig, sizeof(expSig)) == 0);
+    CHECK(memcmp(countOut, expCount, sizeof(expCount)) == 0);
+
+    // A runs out first, the same result the other way round
+    CHECK(CMx_SignatureMerge(sigB, countB, 3, sigA, countA, 4,
+                             sigOut, countOut) == 6);
+    CHECK(memcmp(sigOut, expSig, sizeof(expSig)) == 0);
+    CHECK(memcmp(countOut, expCount, sizeof(expCount)) == 0);
+
+    // Runs that end on the same signature, and the largest signature
+    uint32_t sigC[2] = { 1, 0xFFFFFFFF };
+    uint32_t countC[2] = { 5, 6 };
+    uint32_t sigD[1] = { 0xFFFFFFFF };
+    uint32_t countD[1] = { 7 };
+    CHECK(CMx_SignatureMerge(sigC, countC, 2, sigD, countD, 1,
+                             sigOut, countOut) == 2);
+    CHECK((sigOut[1] == 0xFFFFFFFF) && (countOut[1] == 13));
+}
+
+static void
+TestRollupThenMerge(void)
+{
+    static uint32_t all[MAX_SIGS];
+    static uint32_t sigA[MAX_SIGS / 2];
+    static uint32_t sigB[MAX_SIGS / 2];
+    static uint32_t countA[MAX_SIGS / 2];
+    static uint32_t countB[MAX_SIGS / 2];
+    static uint32_t sigOut[MAX_SIGS];
+    static uint32_t countOut[MAX_SIGS];
+    static uint32_t countAll[MAX_SIGS];
+
+    // Rolling up two halves and merging them is the same as rolling up
+    // the whole batch
+    for (uint32_t i = 0; i < MAX_SIGS; i++)
+    {
+        all[i] = Random() % 200;
+    }
+    memcpy(sigA, all, sizeof(sigA));
+    memcpy(sigB, &all[MAX_SIGS / 2], sizeof(sigB));
+    uint32_t numA = CMx_SignatureRollup(sigA, MAX_SIGS / 2, countA);
+    uint32_t numB = CMx_SignatureRollup(sigB, MAX_SIGS / 2, countB);
+    uint32_t num = CMx_SignatureMerge(sigA, countA, numA, sigB, countB, numB,
+                                      sigOut, countOut);
+    uint32_t numAll = CMx_SignatureRollup(all, MAX_SIGS, countAll);
+    CHECK(num == numAll);
+    CHECK(memcmp(sigOut, all, num * 4) == 0);
+    CHECK(memcmp(countOut, countAll, num * 4) == 0);
+}
+
+static void
+TestBatchSignature(void)
+{
+    uint32_t pc[4] = { 0x00001100, 0x00001100, 0x00001200, 0x08000000 };
+    uint32_t lr[4] = { 0x00001001, 0x00001001, 0x00001001, 0xFFFFFFF9 };
+    uint32_t cfsr[4] = { 0x00008200, 0x00008200, 0x00000001, 0x00000000 };
+    uint32_t hfsr[4] = { 0x40000000, 0x40000000, 0x40000000, 0x80000000 };
+    uint32_t sig[5] = { 0, 0, 0, 0, 0x12345678 };
+
+    CHECK(CMx_ApiVersion() == 2);
+    uint32_t num = CMx_FaultBatchSignature(pc, lr, cfsr, hfsr, 4, sig);
+#ifdef CMX_STABLE_SIGNATURE
+    // The signature needs the captured code, so nothing is written
+    CHECK(num == 0);
+    CHECK((sig[0] | sig[1] | sig[2] | sig[3]) == 0);
+#else
+    // Same as the signature of a record with those fields
+    CHECK(num == 4);
+    for (uint32_t i = 0; i < 4; i++)
+    {
+        tCMxFaultRecord record;
+        memset(&record, 0, sizeof(record));
+        record.frame[5] = lr[i];
+        record.frame[6] = pc[i];
+        record.cfsr = cfsr[i];
+        record.hfsr = hfsr[i];
+        CHECK(sig[i] == CMx_FaultSignature(&record));
+    }
+    CHECK(sig[0] == sig[1]);
+    CHECK(sig[1] != sig[2]);
+#endif
+    CHECK(sig[4] == 0x12345678);
+}
+
+int
+main(void)
+{
+    TestRollup();
+    TestMerge();
+    TestRollupThenMerge();
+    TestBatchSignature();
+
+#ifdef CMX_STABLE_SIGNATURE
+    printf("test_rollup (stable signatures): %s\n",
+           g_failures ? "FAILED" : "passed");
+#else
+    printf("test_rollup: %s\n", g_failures ? "FAILED" : "passed");
+#endif
+    return g_failures ? 1 : 0;
+}
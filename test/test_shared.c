@@ -0,0 +1,108 @@
+/******************************************************************************
+ *
+ * test_shared.c - Host tests of the fault log shared between cores
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#define CMX_FAULT_SHARED_LOG
+#define CMX_FAULT_SHARED_ENTRIES 4
+#define CMX_FAULT_SHARED_WINDOW 10
+#define CMX_CORE_COUNT 2
+#define CMX_CORE_ID() g_coreId
+
+#include "host_sim.h"
+
+/* Core that the test pretends to run on */
+static uint32_t g_coreId;
+
+#include "cmx_fault_decoder.c"
+
+/* Make a record for a fault at the given PC and time */
+static tCMxFaultRecord
+MakeRecord(uint32_t pc, uint32_t timestamp)
+{
+    tCMxFaultRecord record;
+
+    memset(&record, 0, sizeof(record));
+    record.frame[6] = pc;
+    record.cfsr = 0x00000400;
+    record.timestamp = timestamp;
+    return record;
+}
+
+static void
+TestLayout(void)
+{
+    tCMxFaultRecord record = MakeRecord(0x00001100, 10);
+
+    CMx_FaultSharedLogInit(true);
+    CHECK(CMx_FaultSharedLogAdd(&record) == 0);
+
+    // Kept if the layout matches
+    CMx_FaultSharedLogInit(false);
+    CHECK(CMx_FaultSharedLogGet()->entries[0].seq == 1);
+
+    // A log laid out by other firmware is not added to, and is cleared
+    // at startup
+    g_sharedLog.layout ^= 4;
+    CHECK(CMx_FaultSharedLogAdd(&record) == -1);
+    CMx_FaultSharedLogInit(false);
+    CHECK(CMx_FaultSharedLogGet()->entries[0].seq == 0);
+    CHECK(CMx_FaultSharedLogAdd(&record) == 0);
+
+    g_sharedLog.config ^= 1;
+    CHECK(CMx_FaultSharedLogAdd(&record) == -1);
+    CMx_FaultSharedLogInit(false);
+    CHECK(CMx_FaultSharedLogGet()->next == 0);
+}
+
+static void
+TestCorrelate(void)
+{
+    tCMxFaultRecord record;
+
+    CMx_FaultSharedLogInit(true);
+
+    // Core 1 faults in the previous boot, at tick 100
+    g_coreId = 1;
+    record = MakeRecord(0x00001200, 100);
+    CHECK(CMx_FaultSharedLogAdd(&record) == 0);
+
+    // After a reset the tick count starts again.  Core 0 faults at 95 and
+    // core 1's old fault is not related.
+    CMx_FaultSharedLogInit(false);
+    CHECK(CMx_FaultSharedLogGet()->entries[0].seq == 1);
+    g_coreId = 0;
+    record = MakeRecord(0x00001100, 95);
+    int32_t slot = CMx_FaultSharedLogAdd(&record);
+    CHECK(slot == 1);
+    SimOutputClear();
+    CHECK(CMx_FaultSharedCorrelate((uint32_t)slot, CMX_FAULT_SHARED_WINDOW) == 0);
+
+    // Core 1 faults in this boot close to it, that one is related
+    g_coreId = 1;
+    record = MakeRecord(0x00001300, 99);
+    CHECK(CMx_FaultSharedLogAdd(&record) == 2);
+    CHECK(CMx_FaultSharedCorrelate((uint32_t)slot, CMX_FAULT_SHARED_WINDOW) == 1);
+    CHECK(strstr(g_simOutput, "Core 1 also faulted (PC 00001300") != 0);
+    CHECK(strstr(g_simOutput, "PC 00001200") == 0);
+
+    // But not when it is too far away in time, or on the same core
+    record = MakeRecord(0x00001400, 200);
+    slot = CMx_FaultSharedLogAdd(&record);
+    CHECK(CMx_FaultSharedCorrelate((uint32_t)slot, CMX_FAULT_SHARED_WINDOW) == 0);
+    CHECK(CMx_FaultSharedCorrelate(2, CMX_FAULT_SHARED_WINDOW) == 1);
+}
+
+int
+main(void)
+{
+    TestLayout();
+    TestCorrelate();
+
+    printf("test_shared: %s\n", g_failures ? "FAILED" : "passed");
+    return g_failures ? 1 : 0;
+}
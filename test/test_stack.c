@@ -0,0 +1,159 @@
+/******************************************************************************
+ *
+ * test_stack.c - Host tests of the stack headroom and overflow checks
+ *
+ * The decoder takes stack addresses as 32 bit values, so the stacks are
+ * mapped below 4 GB.  If the host won't map memory there the test is
+ * skipped.
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#define _DEFAULT_SOURCE
+
+#include <sys/mman.h>
+
+#include "host_sim.h"
+#include "cmx_fault_decoder.c"
+
+#define STACK_HINT  0x20000000
+#define STACK_BYTES 0x1000
+
+static uint32_t g_stackBase;
+
+/* Map the memory used for stacks below 4 GB */
+static bool
+MapStacks(void)
+{
+    void *p = mmap((void *)(uintptr_t)STACK_HINT, STACK_BYTES,
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+    if (p == MAP_FAILED)
+    {
+        return false;
+    }
+    if (((uintptr_t)p + STACK_BYTES) > 0x100000000ULL)
+    {
+        munmap(p, STACK_BYTES);
+        return false;
+    }
+    g_stackBase = (uint32_t)(uintptr_t)p;
+    return true;
+}
+
+static uint32_t *
+StackWord(uint32_t addr)
+{
+    return (uint32_t *)(uintptr_t)addr;
+}
+
+static void
+TestHeadroom(void)
+{
+    // Every size from empty up to past a few groups of 4 words, so the
+    // tail loop runs with 0 to 3 words left over
+    for (uint32_t words = 0; words <= 13; words++)
+    {
+        uint32_t size = words * 4;
+
+        // All paint
+        memset(StackWord(g_stackBase), 0, STACK_BYTES);
+        CMx_StackPaint(g_stackBase, size);
+        CHECK(CMx_StackHeadroom(g_stackBase, size) == size);
+
+        // The word after the stack is not paint, and is not counted
+        *StackWord(g_stackBase + size) = CMX_STACK_PAINT;
+        CHECK(CMx_StackHeadroom(g_stackBase, size) == size);
+
+        // Used down to each word in turn
+        for (uint32_t used = 0; used < words; used++)
+        {
+            CMx_StackPaint(g_stackBase, size);
+            *StackWord(g_stackBase + (used * 4)) = 0;
+            CHECK(CMx_StackHeadroom(g_stackBase, size) == used * 4);
+        }
+    }
+
+    // Sizes that are not a multiple of 4 round down to whole words
+    CMx_StackPaint(g_stackBase, 64);
+    CHECK(CMx_StackHeadroom(g_stackBase, 23) == 20);
+    CHECK(CMx_StackHeadroom(g_stackBase, 3) == 0);
+}
+
+static uint32_t g_frame[8];
+
+static void
+Capture(tCMxFaultRecord *pRecord)
+{
+    g_frame[6] = SIM_CODE_BASE + 0x40;
+    g_frame[7] = 0x01000000;
+    CMx_FaultCapture(pRecord, g_frame, 0xFFFFFFF9, 0);
+}
+
+static void
+TestOverflow(void)
+{
+    tCMxFaultRecord record;
+    tCMxStack stacks[3] =
+    {
+        { 0, 40 },  // 10 words, checked 4 at a time then 2 alone
+        { 0, 28 },  // 7 words
+        { 0, 64 },  // 16 words
+    };
+
+    SimReset();
+    stacks[0].base = g_stackBase;
+    stacks[1].base = g_stackBase + 0x100;
+    stacks[2].base = g_stackBase + 0x200;
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        CMx_StackPaint(stacks[i].base, stacks[i].size);
+    }
+    CMx_FaultSetStacks(stacks, 3);
+
+    // Untouched stacks
+    Capture(&record);
+    CHECK(record.numStacks == 3);
+    CHECK(record.stackOverflow == 0);
+    CHECK(record.stackHeadroom[0] == 40);
+    CHECK(record.stackHeadroom[1] == 28);
+    CHECK(record.stackHeadroom[2] == 64);
+
+    // Stack 0 used down to just above the guard words is fine
+    *StackWord(stacks[0].base + (CMX_STACK_GUARD_WORDS * 4)) = 0;
+    Capture(&record);
+    CHECK(record.stackOverflow == 0);
+    CHECK(record.stackHeadroom[0] == CMX_STACK_GUARD_WORDS * 4);
+
+    // Overwriting the top guard word of stack 1 is an overflow
+    *StackWord(stacks[1].base + ((CMX_STACK_GUARD_WORDS - 1) * 4)) = 0;
+    Capture(&record);
+    CHECK(record.stackOverflow == 0x2);
+    CHECK(record.stackHeadroom[1] == (CMX_STACK_GUARD_WORDS - 1) * 4);
+
+    // So is overwriting only the lowest word of stack 2, even though the
+    // rest of the guard words still hold the paint
+    *StackWord(stacks[2].base) = 0;
+    Capture(&record);
+    CHECK(record.stackOverflow == 0x6);
+    CHECK(record.stackHeadroom[2] == 0);
+
+    CMx_FaultSetStacks(0, 0);
+}
+
+int
+main(void)
+{
+    if (!MapStacks())
+    {
+        printf("test_stack: skipped, no memory below 4 GB\n");
+        return 0;
+    }
+    TestHeadroom();
+    TestOverflow();
+
+    printf("test_stack: %s\n", g_failures ? "FAILED" : "passed");
+    return g_failures ? 1 : 0;
+}
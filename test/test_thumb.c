@@ -0,0 +1,117 @@
+/******************************************************************************
+ *
+ * test_thumb.c - Host tests of Thumb instruction length and skipping the
+ * faulting instruction
+ *
+ * This is free and unencumbered software released into the public domain.
+ * For more information, please refer to <http://unlicense.org/>
+ *
+ *****************************************************************************/
+
+#include "host_sim.h"
+#include "cmx_fault_decoder.c"
+
+/* xPSR with the Thumb bit, the N and C flags and exception number 3 */
+#define XPSR_BASE 0xA1000003
+
+/* Put an 8-bit IT state in xPSR */
+static uint32_t
+XpsrIt(uint32_t it)
+{
+    return XPSR_BASE | ((it & 0x03) << 25) | ((it & 0xFC) << 8);
+}
+
+static void
+TestInstrLen(void)
+{
+    // 16-bit instructions
+    CHECK(CMx_ThumbInstrLen(0x6800) == 2);      // LDR r0, [r0]
+    CHECK(CMx_ThumbInstrLen(0x4770) == 2);      // BX lr
+    CHECK(CMx_ThumbInstrLen(0xBF18) == 2);      // IT NE
+    CHECK(CMx_ThumbInstrLen(0xDE00) == 2);      // UDF #0
+    CHECK(CMx_ThumbInstrLen(0xE7FE) == 2);      // B .
+    CHECK(CMx_ThumbInstrLen(0x0000) == 2);
+
+    // 32-bit instructions, top 5 bits 0b11101, 0b11110 and 0b11111
+    CHECK(CMx_ThumbInstrLen(0xE8BD) == 4);      // POP.W
+    CHECK(CMx_ThumbInstrLen(0xEBA0) == 4);      // SUB.W
+    CHECK(CMx_ThumbInstrLen(0xF000) == 4);      // BL
+    CHECK(CMx_ThumbInstrLen(0xF7FF) == 4);
+    CHECK(CMx_ThumbInstrLen(0xF8D0) == 4);      // LDR.W
+    CHECK(CMx_ThumbInstrLen(0xFFFF) == 4);
+}
+
+static void
+TestSkip(void)
+{
+    uint32_t frame[8] = { 0 };
+
+    // No IT block, xPSR is left alone
+    frame[6] = 0x00001000;
+    frame[7] = XPSR_BASE;
+    CHECK(CMx_FaultSkipInstruction(frame, 0x6800) == 2);
+    CHECK(frame[6] == 0x00001002);
+    CHECK(frame[7] == XPSR_BASE);
+
+    CHECK(CMx_FaultSkipInstruction(frame, 0xF8D0) == 4);
+    CHECK(frame[6] == 0x00001006);
+    CHECK(frame[7] == XPSR_BASE);
+}
+
+static void
+TestSkipIt(void)
+{
+    uint32_t frame[8] = { 0 };
+
+    // ITTE NE: IT state 0x1A, then 0x14, then 0x08, then out of the block.
+    // Fault on the first instruction of the block.
+    frame[6] = 0x00002000;
+    frame[7] = XpsrIt(0x1A);
+    CHECK(CMx_FaultSkipInstruction(frame, 0x6800) == 2);
+    CHECK(frame[6] == 0x00002002);
+    CHECK(frame[7] == XpsrIt(0x14));
+
+    // Middle instruction, a 32-bit one
+    CHECK(CMx_FaultSkipInstruction(frame, 0xF8D0) == 4);
+    CHECK(frame[6] == 0x00002006);
+    CHECK(frame[7] == XpsrIt(0x08));
+
+    // Last instruction, the IT state is cleared
+    CHECK(CMx_FaultSkipInstruction(frame, 0x6800) == 2);
+    CHECK(frame[6] == 0x00002008);
+    CHECK(frame[7] == XPSR_BASE);
+
+    // ITE GE, the condition bits in IT[7:5] are kept: 0xAC then 0xB8
+    frame[7] = XpsrIt(0xAC);
+    CMx_FaultSkipInstruction(frame, 0x6800);
+    CHECK(frame[7] == XpsrIt(0xB8));
+    CMx_FaultSkipInstruction(frame, 0x6800);
+    CHECK(frame[7] == XPSR_BASE);
+
+    // IT with a single instruction, which is both the first and the last
+    frame[7] = XpsrIt(0x18);
+    CMx_FaultSkipInstruction(frame, 0x6800);
+    CHECK(frame[7] == XPSR_BASE);
+
+    // ITTTT EQ, four instructions
+    frame[7] = XpsrIt(0x01);
+    CMx_FaultSkipInstruction(frame, 0x6800);
+    CHECK(frame[7] == XpsrIt(0x02));
+    CMx_FaultSkipInstruction(frame, 0x6800);
+    CHECK(frame[7] == XpsrIt(0x04));
+    CMx_FaultSkipInstruction(frame, 0x6800);
+    CHECK(frame[7] == XpsrIt(0x08));
+    CMx_FaultSkipInstruction(frame, 0x6800);
+    CHECK(frame[7] == XPSR_BASE);
+}
+
+int
+main(void)
+{
+    TestInstrLen();
+    TestSkip();
+    TestSkipIt();
+
+    printf("test_thumb: %s\n", g_failures ? "FAILED" : "passed");
+    return g_failures ? 1 : 0;
+}